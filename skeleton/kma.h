@@ -91,6 +91,19 @@ EXTERN void* kma_malloc(kma_size_t size);
  ***********************************************************************/
 EXTERN void kma_free(void*, kma_size_t size);
 
+#ifdef KMA_STATS
+/***********************************************************************
+ *  Title: Prints allocator statistics
+ * ---------------------------------------------------------------------
+ *    Purpose: Prints the algorithm specific counters (splits, merges,
+ *             ...) collected when built with -DKMA_STATS. Algorithms
+ *             without counters need not define it
+ *    Input: none
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kma_stats();
+#endif
+
 /************External Declaration*****************************************/
 
 /**************Definition***************************************************/
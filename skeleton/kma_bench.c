@@ -0,0 +1,103 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Benchmark driver for the kernel memory allocator
+ *    Author: Jin Sun, Yuchao Zhou
+ *    Copyright: 2014 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  The driver replays a trace file like the test harness in kma.c,
+ *  but without touching or checking the allocated memory. The whole
+ *  trace is parsed up front so that only kma_malloc and kma_free are
+ *  timed. It is linked instead of kma.c, see the bench target in the
+ *  Makefile.
+ ***************************************************************************/
+#define __KMA_TEST_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+#include "kma_trace.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+
+/************External Declaration*****************************************/
+
+// only algorithms built with -DKMA_STATS that keep counters define it
+void kma_stats() __attribute__((weak));
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  int n_req, n_ops, i, round;
+  int rounds = 1;
+
+  name = argv[0];
+
+  if (argc != 2 && argc != 3)
+    {
+      usage();
+    }
+  if (argc == 3)
+    {
+      rounds = atoi(argv[2]);
+    }
+
+  op_t* ops = readTrace(argv[1], &n_req, &n_ops);
+  void** ptrs = malloc(n_req * sizeof(void*));
+  int* sizes = malloc(n_req * sizeof(int));
+  assert(ptrs != NULL && sizes != NULL);
+
+  double begin = now();
+  for (round = 0; round < rounds; round++)
+    {
+      for (i = 0; i < n_ops; i++)
+	{
+	  op_t* op = &ops[i];
+
+	  if (op->type == OP_REQUEST)
+	    {
+	      sizes[op->id] = op->size;
+	      ptrs[op->id] = kma_malloc(op->size);
+	    }
+	  else if (ptrs[op->id] != NULL)
+	    {
+	      kma_free(ptrs[op->id], sizes[op->id]);
+	    }
+	}
+    }
+  double elapsed = now() - begin;
+
+  kma_page_stat_t* stat = page_stats();
+
+  printf("%s: %d ops in %.3f ms, %.1f ns/op\n", argv[1], n_ops * rounds,
+	 elapsed * 1e3, elapsed * 1e9 / ((double) n_ops * rounds));
+  printf("Page Requested/Freed/In Use: %5d/%5d/%5d\n",
+	 stat->num_requested, stat->num_freed, stat->num_in_use);
+
+  if (kma_stats)
+    {
+      kma_stats();
+    }
+
+  free(ops);
+  free(ptrs);
+  free(sizes);
+  return 0;
+}
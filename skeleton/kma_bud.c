@@ -40,10 +40,12 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/mman.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
 #include "kma.h"
+#include "kma_mag.h"
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -52,50 +54,64 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
-typedef struct
-{
-  void* head;
-  void* prev;
-  kma_page_t* page;
-  unsigned char size;
-} buffer_t;
+// smallest block, a free block must hold its two list links
+#define MINORDER 4
+// a whole page
+#define MAXORDER 13
+// smallest blocks in a page, every block starts at one of them
+#define SLOTS (1 << (MAXORDER - MINORDER))
+// flag in the slot of a block that is on the free list of its order
+#define FREEBLOCK 0x80
 
-typedef struct free_list_t
+// free block, the links only exist while the block is free
+typedef struct block_t
 {
-  unsigned char size;
-  struct free_list_t * up;
-  buffer_t * start;
-} freelist_t;
+  struct block_t* next;
+  struct block_t* prev;
+} block_t;
 
+// per-page side table entry, indexed by page_index(). Blocks carry no
+// header, so every block starts at its natural alignment
 typedef struct
 {
-  freelist_t buffer_32;
-  freelist_t buffer_64;
-  freelist_t buffer_128;
-  freelist_t buffer_256;
-  freelist_t buffer_512;
-  freelist_t buffer_1024;
-  freelist_t buffer_2048;
-  freelist_t buffer_4096;
-  freelist_t buffer_8192;
-  int used;
-} mainlist_t;
+  kma_page_t* page;
+  // order of the run if the page starts a multi-page block, else 0
+  unsigned char run;
+  // order of the block that starts at each slot, with FREEBLOCK set
+  // while the block is free, 0 if no block starts there
+  unsigned char slots[SLOTS];
+} budpage_t;
 
 /************Global Variables*********************************************/
-kma_page_t * start = NULL;
+block_t* freelists[MAXORDER + 1];
+// bit k is set if the list of order k is nonempty
+unsigned int nonempty = 0;
+// MAXPAGES entries, mapped on first use without reserving memory, so
+// only the entries of pages that are handed out get backed
+budpage_t* budpages = NULL;
 
+#ifdef KMA_STATS
+int nsplits = 0;
+int nmerges = 0;
+#endif
 
 /************Function Prototypes******************************************/
-//set up admin struct
-void initPage(void);
-//returns a buffer for the user
-void* getBuffer(freelist_t*);
-//returns the buddy of a buffer
-void* getBuddy(void*,int);
-//removes a free buffer from said list
-void removeFromFreelist(buffer_t*,freelist_t*);
-//free a buffer
-void freeAndMerge(void*);
+//map the side table
+void initTable();
+//order of the smallest block that holds size bytes
+int sizeToOrder(int);
+//order of an allocated block, from the side table
+int blockOrder(budpage_t*, void*);
+//slot of a block in the side table of its page
+int blockSlot(void*);
+//push a free block of the page and mark it free
+void pushFree(budpage_t*, block_t*, int);
+//unlink a free block of the page and mark it used
+void removeFree(budpage_t*, block_t*, int);
+
+#if MAXORDER >= FREEBLOCK
+#error "the order of a block must not overlap FREEBLOCK"
+#endif
 
 /************External Declaration*****************************************/
 
@@ -103,192 +119,165 @@ void freeAndMerge(void*);
 
 void* kma_malloc(kma_size_t size)
 {
-  // printf("start kma allocate\n");
-  if(start == NULL){
-    //set up admin data
-    initPage();
+  int order = sizeToOrder(size);
+  if (order > MAXORDER + MAXPAGEORDER)
+    return NULL;
+  if (budpages == NULL)
+    initTable();
+  if (order > MAXORDER) {
+    // a run of pages, aligned to its size by the page layer
+    kma_page_t* run = get_pages(order - MAXORDER);
+    budpage_t* entry = &budpages[page_index(run->ptr)];
+    entry->page = run;
+    entry->run = order;
+    return run->ptr;
   }
-  void* result = NULL;
-  mainlist_t* mainlist = (mainlist_t*)((void*)start->ptr + sizeof(buffer_t));
-  freelist_t* request = NULL;
-  int adjusted = size + sizeof(buffer_t);
-  if (adjusted <= 32)
-    request = &mainlist->buffer_32;
-  else if (adjusted <= 64)
-    request = &mainlist->buffer_64;
-  else if (adjusted <= 128)
-    request = &mainlist->buffer_128;
-  else if (adjusted <= 256)
-    request = &mainlist->buffer_256;
-  else if (adjusted <= 512)
-    request = &mainlist->buffer_512;
-  else if (adjusted <= 1024)
-    request = &mainlist->buffer_1024;
-  else if (adjusted <= 2048)
-    request = &mainlist->buffer_2048;
-  else if (adjusted <= 4096)
-    request = &mainlist->buffer_4096;
-  else if (adjusted <= 8192)
-    request = &mainlist->buffer_8192;
 
-  if (request != NULL)
-    result = getBuffer(request);
+  // smallest nonempty order that is large enough
+  unsigned int avail = nonempty & (~0U << order);
+
+  budpage_t* entry;
+  block_t* buf;
+  int found;
+  if (avail == 0) {
+    // get a new page, it is handed out as one block of MAXORDER. Its
+    // slots are clear, a page only goes back once every block merged
+    kma_page_t* page = get_page();
+    entry = &budpages[page_index(page->ptr)];
+    entry->page = page;
+    entry->run = 0;
+    buf = (block_t*)page->ptr;
+    found = MAXORDER;
+  }
+  else {
+    found = __builtin_ctz(avail);
+    buf = freelists[found];
+    entry = &budpages[page_index(buf)];
+    removeFree(entry, buf, found);
+  }
 
-  return result;
+  // split down, the upper halves stay free
+  while (found > order) {
+    found--;
+    pushFree(entry, (block_t*)((void*)buf + (1 << found)), found);
+#ifdef KMA_STATS
+    nsplits++;
+#endif
+  }
+  entry->slots[blockSlot(buf)] = order;
+  return (void*)buf;
 }
 
 void kma_free(void* ptr, kma_size_t size)
 {
-  freeAndMerge(ptr);
-  mainlist_t* mainlist = (mainlist_t*)((void*)start->ptr + sizeof(buffer_t));
-  if (mainlist->used == 0) {
-    free_page(start);
-    start = NULL;
+  block_t* buf = (block_t*)ptr;
+  budpage_t* entry = &budpages[page_index(buf)];
+
+  if (entry->run && (void*)buf == entry->page->ptr) {
+    // a run of pages goes straight back
+    assert(entry->run == sizeToOrder(size));
+    free_pages(ptr, entry->run - MAXORDER);
+    entry->page = NULL;
+    entry->run = 0;
+    return;
+  }
+
+  int order = blockOrder(entry, buf);
+  assert(order == sizeToOrder(size));
+  entry->slots[blockSlot(buf)] = 0;
+
+  // merge while the buddy is free
+  while (order < MAXORDER) {
+    block_t* bud = (block_t*)((uintptr_t)buf ^ (1 << order));
+    if (entry->slots[blockSlot(bud)] != (FREEBLOCK | order))
+      break;
+    removeFree(entry, bud, order);
+#ifdef KMA_STATS
+    nmerges++;
+#endif
+    if (bud < buf)
+      buf = bud;
+    order++;
+  }
+
+  if (order == MAXORDER) {
+    free_page(entry->page);
+    entry->page = NULL;
   }
+  else
+    pushFree(entry, buf, order);
 }
 
-void initPage()
+void initTable()
 {
-  /* set everythin up, initialize values */
-  start = get_page();
-  mainlist_t * mainlist = (mainlist_t*)((void*)start->ptr+sizeof(buffer_t));
-
-  mainlist->buffer_32.size = 5;
-  mainlist->buffer_64.size = 6;
-  mainlist->buffer_128.size = 7;
-  mainlist->buffer_256.size = 8;
-  mainlist->buffer_512.size = 9;
-  mainlist->buffer_1024.size = 10;
-  mainlist->buffer_2048.size = 11;
-  mainlist->buffer_4096.size = 12;
-  mainlist->buffer_8192.size = 13;
+  budpages = mmap(NULL, MAXPAGES * sizeof(budpage_t), PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (budpages == MAP_FAILED)
+    error("Error using mmap to map the buddy side table", "");
+}
 
-  mainlist->buffer_32.up = &mainlist->buffer_64;
-  mainlist->buffer_64.up = &mainlist->buffer_128;
-  mainlist->buffer_128.up = &mainlist->buffer_256;
-  mainlist->buffer_256.up = &mainlist->buffer_512;
-  mainlist->buffer_512.up = &mainlist->buffer_1024;
-  mainlist->buffer_1024.up = &mainlist->buffer_2048;
-  mainlist->buffer_2048.up = &mainlist->buffer_4096;
-  mainlist->buffer_4096.up = &mainlist->buffer_8192;
-  mainlist->buffer_8192.up = NULL;
+int blockOrder(budpage_t* entry, void* buf)
+{
+  int order = entry->slots[blockSlot(buf)];
+  // a free block has FREEBLOCK set, and blocks are naturally aligned
+  assert(order >= MINORDER && order <= MAXORDER);
+  assert(((uintptr_t)buf & ((1 << order) - 1)) == 0);
+  return order;
+}
 
-  mainlist->buffer_32.start = NULL;
-  mainlist->buffer_64.start = NULL;
-  mainlist->buffer_128.start = NULL;
-  mainlist->buffer_256.start = NULL;
-  mainlist->buffer_512.start = NULL;
-  mainlist->buffer_1024.start = NULL;
-  mainlist->buffer_2048.start = NULL;
-  mainlist->buffer_4096.start = NULL;
-  mainlist->buffer_8192.start = NULL;
-  mainlist->used = 0;
+int blockSlot(void* buf)
+{
+  return ((uintptr_t)buf & (PAGESIZE - 1)) >> MINORDER;
+}
 
-  buffer_t* buf = start->ptr;
-  buf->head = NULL;
-  mainlist->buffer_8192.start = buf;
+void pushFree(budpage_t* entry, block_t* buf, int order)
+{
+  entry->slots[blockSlot(buf)] = FREEBLOCK | order;
   buf->prev = NULL;
-  kma_malloc(sizeof(mainlist_t));
-  mainlist->used = 0;
+  buf->next = freelists[order];
+  if (buf->next != NULL)
+    buf->next->prev = buf;
+  freelists[order] = buf;
+  nonempty |= 1U << order;
 }
 
-void *getBuffer(freelist_t* list)
+void removeFree(budpage_t* entry, block_t* buf, int order)
 {
-  mainlist_t* mainlist = (mainlist_t*)((void*)start->ptr+sizeof(buffer_t));
-  mainlist->used++;
-  if (list->start == NULL){
-    if (list->up == NULL){
-      // get a new page
-      kma_page_t* page = get_page();
-      buffer_t* buf = (buffer_t*)page->ptr;
-      buf->page = page;
-      buf->head = (void*)list;
-      buf->size = list->size;
-      return ((void*)buf + sizeof(buffer_t));
-    }
-    else {
-      buffer_t* bufb = (buffer_t*)((void*)getBuffer(list->up)-sizeof(buffer_t));
-      uintptr_t offset = 0x1 << list->size;
-      buffer_t* bufa = (buffer_t*)((void*)bufb + offset);
-      if(list->start != NULL)
-        list->start->prev = bufa;
-      bufa->head = (void*)list->start;
-      list->start = bufa;
-      bufa->prev = NULL;
-      bufa->size = list->size;
-      bufb->head = (void*)list;
-      bufb->size = list->size;
-      return ((void*)bufb + sizeof(buffer_t));
-    }
-  }
-  buffer_t* buf = list->start;
-  list->start = buf->head;
-  buf->head = (void*)list;
-  buf->size = list->size;
-  if(list->start!=NULL) {
-    list->start->prev = NULL;
+  entry->slots[blockSlot(buf)] = 0;
+  if (buf->prev != NULL)
+    buf->prev->next = buf->next;
+  else {
+    freelists[order] = buf->next;
+    if (buf->next == NULL)
+      nonempty &= ~(1U << order);
   }
-  return ((void*)buf+sizeof(buffer_t));
+  if (buf->next != NULL)
+    buf->next->prev = buf->prev;
 }
 
-void freeAndMerge(void* ptr)
+int sizeToOrder(int size)
 {
-  mainlist_t*mainlist = (mainlist_t*)((void*)start->ptr+sizeof(buffer_t));
-  mainlist->used--;
-  buffer_t* buf = (buffer_t*)((void*)ptr-sizeof(buffer_t));
-  freelist_t* list = (freelist_t*)buf->head;
-
-  buffer_t* bud = (buffer_t*) getBuddy((void*)buf,list->size);
-
-  if ((bud->head == buf->head) || (list->up == NULL) || (buf->size != bud->size))  //bud is still used so just return buf to list
-  {
-    if (list->up == NULL){
-      free_page(buf->page);
-    }
-    else{
-      if(list->start != NULL)
-        list->start->prev = buf;
-      buf->head = (void*)list->start;
-      list->start = buf;
-      buf->prev = NULL;
-    }
-  }
-  else  //same size
-  {
-    removeFromFreelist(bud,list);
-    if (bud < buf) {
-      buffer_t* temp = buf;
-      buf = bud;
-      bud = temp;
-    }
-    buf->head = list->up;
-    buf->size++;
-    freeAndMerge((void*)buf+sizeof(buffer_t));
-  }
+  // ceil(log2(size)), but no smaller than the smallest block
+  if (size <= (1 << MINORDER))
+    return MINORDER;
+  return 32 - __builtin_clz(size - 1);
 }
 
-void* getBuddy(void*buf,int size)
+#ifdef KMA_MAGAZINE
+// size class for the magazine layer, the order of the free list
+int magClass(kma_size_t size)
 {
-  // returns the address of the buffer's buddy
-  uintptr_t flipper = 1<<size;
-  uintptr_t address = (uintptr_t)buf;
-  return (void*)(address^flipper);
+  if (size > PAGESIZE)
+    return -1;
+  return sizeToOrder(size);
 }
+#endif
 
-void removeFromFreelist(buffer_t* buf, freelist_t* list)
+#ifdef KMA_STATS
+void kma_stats()
 {
-  // removes a buffer from its free list
-  buffer_t* next = (buffer_t*)buf->head;
-  buffer_t* prev = (buffer_t*)buf->prev;
-  if (list->start==buf) {
-    list->start = next;
-  }
-  if (next!=NULL){
-    next->prev = prev;
-  }
-  if (prev!=NULL){
-    prev->head = next;
-  }
+  printf("splits: %d merges: %d\n", nsplits, nmerges);
 }
+#endif
 
 #endif // KMA_BUD
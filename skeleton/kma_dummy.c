@@ -73,10 +73,8 @@ void* kma_malloc(kma_size_t size)
   // get one page
   page = get_page();
   
-  // add a pointer to the page structure at the beginning of the page
-  *((kma_page_t**)page->ptr) = page;
-  
-  if ((size + sizeof(kma_page_t*)) > page->size)
+  // kma_free finds the page structure with page_of()
+  if (size > page->size)
     { // requested size too large
       free_page(page);
       return NULL;
@@ -89,16 +87,12 @@ void* kma_malloc(kma_size_t size)
   //}
   // oh yea, it worked
   
-  return page->ptr + sizeof(kma_page_t*);
+  return page->ptr;
 }
 
 void kma_free(void* ptr, kma_size_t size)
 {
-  kma_page_t* page;
-  
-  page = *((kma_page_t**)(ptr - sizeof(kma_page_t*)));
-  
-  free_page(page);
+  free_page(page_of(ptr));
 }
 
 #endif // KMA_DUMMY
@@ -38,6 +38,8 @@
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -50,24 +52,241 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+
+#define MINORDER 6
+#define MAXORDER 13
+
+// buffer states
+#define ALLOCATED 0
+#define LOCALFREE 1
+#define GLOBALFREE 2
+
+typedef struct buffer_struct
+{
+  struct buffer_struct* next;
+  struct buffer_struct* prev;
+  unsigned char order;
+  // a locally free buffer still looks allocated to its buddy
+  unsigned char state;
+} buffer_t;
+
+typedef struct
+{
+  // buffers that may be coalesced with their buddy
+  buffer_t* global;
+  // buffers that were freed lazily, reused first on allocation
+  buffer_t* local;
+  // N, L and G of the slack computation
+  int active;
+  int nlocal;
+  int nglobal;
+} freelist_t;
+
 /************Global Variables*********************************************/
+freelist_t lists[MAXORDER + 1];
+// buffers handed out over all orders
+int used = 0;
+// set for pages handed out whole, indexed by page_index(); such a
+// request does not fit a page together with the buffer header
+unsigned char wholePage[MAXPAGES];
+
+#ifdef KMA_STATS
+int nsplits = 0;
+int nmerges = 0;
+int nlazy = 0;
+#endif
 
 /************Function Prototypes******************************************/
+//returns a free buffer of the given order, splitting if needed
+buffer_t* takeBuffer(int);
+//frees a buffer and coalesces it with its buddies
+void releaseGlobal(buffer_t*);
+//returns the buddy of a buffer
+buffer_t* getBuddy(buffer_t*);
+//pushes a buffer on one of the free lists of its order
+void pushBuffer(buffer_t**, buffer_t*);
+//unlinks a buffer from one of the free lists of its order
+void unlinkBuffer(buffer_t**, buffer_t*);
 
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
 
-void*
-kma_malloc(kma_size_t size)
+void* kma_malloc(kma_size_t size)
+{
+  int adjusted = size + sizeof(buffer_t);
+  int order = MINORDER;
+
+  if (size > PAGESIZE)
+    return NULL;
+  if (adjusted > PAGESIZE) {
+    // too large for the header, it gets a dedicated page
+    kma_page_t* page = get_page();
+    wholePage[page_index(page->ptr)] = 1;
+    return page->ptr;
+  }
+  while ((1 << order) < adjusted)
+    order++;
+
+  buffer_t* buf = takeBuffer(order);
+  buf->state = ALLOCATED;
+  lists[order].active++;
+  used++;
+  return ((void*)buf + sizeof(buffer_t));
+}
+
+void kma_free(void* ptr, kma_size_t size)
+{
+  // buffers start after their header, so only a whole page is aligned
+  if (ptr == BASEADDR(ptr) && wholePage[page_index(ptr)]) {
+    wholePage[page_index(ptr)] = 0;
+    free_page(page_of(ptr));
+    return;
+  }
+
+  buffer_t* buf = (buffer_t*)(ptr - sizeof(buffer_t));
+  freelist_t* list = &lists[buf->order];
+  int slack = list->active - 2 * list->nlocal - list->nglobal;
+
+  list->active--;
+  used--;
+
+  if (slack >= 2) {
+    // lazy state: keep the buffer in the local pool, no coalescing
+    buf->state = LOCALFREE;
+    pushBuffer(&list->local, buf);
+    list->nlocal++;
+#ifdef KMA_STATS
+    nlazy++;
+#endif
+  }
+  else {
+    // reclaiming state: release this buffer to the buddy system
+    releaseGlobal(buf);
+    // accelerated state: release one more locally free buffer
+    if (slack <= 0 && list->local != NULL) {
+      buffer_t* old = list->local;
+      unlinkBuffer(&list->local, old);
+      list->nlocal--;
+      releaseGlobal(old);
+    }
+  }
+
+  // nothing allocated anymore, flush the local pools so that
+  // every page goes back to the page layer
+  if (used == 0) {
+    int order;
+    for (order = MINORDER; order <= MAXORDER; order++) {
+      while (lists[order].local != NULL) {
+        buffer_t* old = lists[order].local;
+        unlinkBuffer(&lists[order].local, old);
+        lists[order].nlocal--;
+        releaseGlobal(old);
+      }
+    }
+  }
+}
+
+buffer_t* takeBuffer(int order)
+{
+  freelist_t* list = &lists[order];
+  buffer_t* buf;
+
+  // locally free buffers are preferred, they are already marked allocated
+  if (list->local != NULL) {
+    buf = list->local;
+    unlinkBuffer(&list->local, buf);
+    list->nlocal--;
+    return buf;
+  }
+  if (list->global != NULL) {
+    buf = list->global;
+    unlinkBuffer(&list->global, buf);
+    list->nglobal--;
+    return buf;
+  }
+  if (order == MAXORDER) {
+    // get a new page
+    kma_page_t* page = get_page();
+    buf = (buffer_t*)page->ptr;
+    buf->order = MAXORDER;
+    return buf;
+  }
+
+  // split a larger buffer, the upper half becomes globally free
+  buf = takeBuffer(order + 1);
+  buffer_t* half = (buffer_t*)((void*)buf + (1 << order));
+  buf->order = order;
+  half->order = order;
+  half->state = GLOBALFREE;
+  pushBuffer(&list->global, half);
+  list->nglobal++;
+#ifdef KMA_STATS
+  nsplits++;
+#endif
+  return buf;
+}
+
+void releaseGlobal(buffer_t* buf)
+{
+  int order = buf->order;
+
+  while (order < MAXORDER) {
+    buffer_t* bud = getBuddy(buf);
+    // the buddy is in use, split, or only locally free
+    if (bud->state != GLOBALFREE || bud->order != order)
+      break;
+    unlinkBuffer(&lists[order].global, bud);
+    lists[order].nglobal--;
+    if (bud < buf)
+      buf = bud;
+    order++;
+    buf->order = order;
+#ifdef KMA_STATS
+    nmerges++;
+#endif
+  }
+
+  if (order == MAXORDER) {
+    free_page(page_of(buf));
+    return;
+  }
+  buf->state = GLOBALFREE;
+  pushBuffer(&lists[order].global, buf);
+  lists[order].nglobal++;
+}
+
+buffer_t* getBuddy(buffer_t* buf)
+{
+  // returns the address of the buffer's buddy
+  uintptr_t flipper = 1 << buf->order;
+  return (buffer_t*)((uintptr_t)buf ^ flipper);
+}
+
+void pushBuffer(buffer_t** head, buffer_t* buf)
+{
+  buf->prev = NULL;
+  buf->next = *head;
+  if (*head != NULL)
+    (*head)->prev = buf;
+  *head = buf;
+}
+
+void unlinkBuffer(buffer_t** head, buffer_t* buf)
 {
-  return NULL;
+  if (buf->prev != NULL)
+    buf->prev->next = buf->next;
+  else
+    *head = buf->next;
+  if (buf->next != NULL)
+    buf->next->prev = buf->prev;
 }
 
-void
-kma_free(void* ptr, kma_size_t size)
+#ifdef KMA_STATS
+void kma_stats()
 {
-  ;
+  printf("splits: %d merges: %d lazy frees: %d\n", nsplits, nmerges, nlazy);
 }
+#endif
 
 #endif // KMA_LZBUD
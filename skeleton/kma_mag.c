@@ -0,0 +1,298 @@
+/***************************************************************************
+ *  Title: Magazine Layer
+ * -------------------------------------------------------------------------
+ *    Purpose: Per-class object caching in front of an algorithm, after
+ *             Bonwick and Adams' magazines and depot
+ *    Author: Jin Sun, Yuchao Zhou
+ *    Copyright: 2014 Northwestern University
+ ***************************************************************************/
+#if defined(KMA_MAGAZINE) && (defined(KMA_P2FL) || defined(KMA_BUD) || defined(KMA_SLAB))
+#define __KMA_IMPL__
+#define __KMA_MAG_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+#include "kma_mag.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// rounds per magazine (M)
+#ifndef MAGSIZE
+#define MAGSIZE 14
+#endif
+// full magazines the depot keeps per class before objects go back
+#ifndef DEPOTMAX
+#define DEPOTMAX 2
+#endif
+
+typedef struct magazine_struct
+{
+	struct magazine_struct* next;
+	int rounds;
+	void* round[MAGSIZE];
+} magazine;
+
+// the magazines an allocating context holds for one class
+typedef struct
+{
+	magazine* loaded;
+	magazine* previous;
+} context;
+
+// magazines parked in the depot for one class
+typedef struct
+{
+	magazine* full;
+	magazine* empty;
+	int fullCount;
+	// a request size of this class, passed back on a flush
+	kma_size_t size;
+} depot;
+
+/************Global Variables*********************************************/
+context contexts[MAGCLASSES];
+depot depots[MAGCLASSES];
+// objects handed out to the user
+int live = 0;
+
+#ifdef KMA_STATS
+int allocHits = 0;
+int allocMisses = 0;
+int freeHits = 0;
+int freeMisses = 0;
+#endif
+
+/************Function Prototypes******************************************/
+// take a round from the context, NULL on a miss
+void* magAlloc(int cls);
+// put a round in the context, FALSE on a miss
+bool magFree(int cls, void* ptr, kma_size_t size);
+// give every cached object and magazine back to the algorithm
+void magFlush();
+// pop a magazine from a depot list
+magazine* depotGet(magazine** list);
+// push a magazine on a depot list
+void depotPut(magazine** list, magazine* mag);
+
+/************External Declaration*****************************************/
+// only defined if the algorithm keeps counters
+void backendStats() __attribute__((weak));
+
+/**************Implementation***********************************************/
+
+/**
+ * allocate memory
+ **/
+void*
+kma_malloc(kma_size_t size)
+{
+	int cls = magClass(size);
+	void* ptr = NULL;
+
+	if (cls >= 0)
+	{
+		ptr = magAlloc(cls);
+	}
+	if (!ptr)
+	{
+		ptr = backendMalloc(size);
+	}
+	if (ptr)
+	{
+		live++;
+	}
+	return ptr;
+}
+
+/**
+ * free memory
+ **/
+void
+kma_free(void* ptr, kma_size_t size)
+{
+	int cls = magClass(size);
+
+	live--;
+	if (live > 0 && cls >= 0 && magFree(cls, ptr, size))
+	{
+		return;
+	}
+	backendFree(ptr, size);
+	// nothing allocated anymore, the algorithm gets everything back
+	if (live == 0)
+	{
+		magFlush();
+	}
+}
+
+/**
+ * take a round from the context, NULL on a miss
+ **/
+void* magAlloc(int cls)
+{
+	context* ctx = &contexts[cls];
+	depot* dep = &depots[cls];
+
+	if (ctx->loaded && ctx->loaded->rounds == 0
+	    && ctx->previous && ctx->previous->rounds > 0)
+	{
+		magazine* tmp = ctx->loaded;
+		ctx->loaded = ctx->previous;
+		ctx->previous = tmp;
+	}
+	if ((!ctx->loaded || ctx->loaded->rounds == 0) && dep->full)
+	{
+		// trade the empty previous magazine for a full one
+		if (ctx->previous)
+		{
+			depotPut(&dep->empty, ctx->previous);
+		}
+		ctx->previous = ctx->loaded;
+		ctx->loaded = depotGet(&dep->full);
+		dep->fullCount--;
+	}
+	if (!ctx->loaded || ctx->loaded->rounds == 0)
+	{
+#ifdef KMA_STATS
+		allocMisses++;
+#endif
+		return NULL;
+	}
+#ifdef KMA_STATS
+	allocHits++;
+#endif
+	return ctx->loaded->round[--ctx->loaded->rounds];
+}
+
+/**
+ * put a round in the context, FALSE on a miss
+ **/
+bool magFree(int cls, void* ptr, kma_size_t size)
+{
+	context* ctx = &contexts[cls];
+	depot* dep = &depots[cls];
+
+	if (ctx->loaded && ctx->loaded->rounds == MAGSIZE
+	    && ctx->previous && ctx->previous->rounds < MAGSIZE)
+	{
+		magazine* tmp = ctx->loaded;
+		ctx->loaded = ctx->previous;
+		ctx->previous = tmp;
+	}
+	if (!ctx->loaded || ctx->loaded->rounds == MAGSIZE)
+	{
+		magazine* empty = NULL;
+		// the depot may only grow while it holds few full magazines
+		if (dep->fullCount < DEPOTMAX)
+		{
+			empty = depotGet(&dep->empty);
+			if (!empty)
+			{
+				empty = backendMalloc(sizeof(magazine));
+			}
+		}
+		if (!empty)
+		{
+#ifdef KMA_STATS
+			freeMisses++;
+#endif
+			return FALSE;
+		}
+		// trade the full previous magazine for an empty one
+		if (ctx->previous)
+		{
+			depotPut(&dep->full, ctx->previous);
+			dep->fullCount++;
+		}
+		ctx->previous = ctx->loaded;
+		empty->rounds = 0;
+		ctx->loaded = empty;
+	}
+	dep->size = size;
+#ifdef KMA_STATS
+	freeHits++;
+#endif
+	ctx->loaded->round[ctx->loaded->rounds++] = ptr;
+	return TRUE;
+}
+
+/**
+ * give every cached object and magazine back to the algorithm
+ **/
+void magFlush()
+{
+	int cls, i;
+	magazine* mag;
+
+	for (cls = 0; cls < MAGCLASSES; cls++)
+	{
+		context* ctx = &contexts[cls];
+		depot* dep = &depots[cls];
+
+		if (ctx->loaded)
+		{
+			depotPut(&dep->full, ctx->loaded);
+		}
+		if (ctx->previous)
+		{
+			depotPut(&dep->full, ctx->previous);
+		}
+		ctx->loaded = NULL;
+		ctx->previous = NULL;
+
+		while ((mag = depotGet(&dep->full)) != NULL)
+		{
+			for (i = 0; i < mag->rounds; i++)
+			{
+				backendFree(mag->round[i], dep->size);
+			}
+			backendFree(mag, sizeof(magazine));
+		}
+		while ((mag = depotGet(&dep->empty)) != NULL)
+		{
+			backendFree(mag, sizeof(magazine));
+		}
+		dep->fullCount = 0;
+	}
+}
+
+magazine* depotGet(magazine** list)
+{
+	magazine* mag = *list;
+	if (mag)
+	{
+		*list = mag->next;
+	}
+	return mag;
+}
+
+void depotPut(magazine** list, magazine* mag)
+{
+	mag->next = *list;
+	*list = mag;
+}
+
+#ifdef KMA_STATS
+void kma_stats()
+{
+	printf("magazine alloc hits: %d misses: %d, free hits: %d misses: %d\n",
+	       allocHits, allocMisses, freeHits, freeMisses);
+	if (backendStats)
+	{
+		backendStats();
+	}
+}
+#endif
+
+#endif // KMA_MAGAZINE
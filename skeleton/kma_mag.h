@@ -0,0 +1,67 @@
+/***************************************************************************
+ *  Title: Magazine Layer
+ * -------------------------------------------------------------------------
+ *    Purpose: Interface between the magazine layer and the algorithm
+ *             it caches objects for
+ *    Author: Jin Sun, Yuchao Zhou
+ *    Copyright: 2014 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  Built with -DKMA_MAGAZINE, kma_mag.c provides kma_malloc and kma_free
+ *  and keeps freed objects in per-class magazines. The algorithm below
+ *  it includes this header, which renames its own kma_malloc and
+ *  kma_free to backendMalloc and backendFree, and defines magClass().
+ *  Without -DKMA_MAGAZINE this header changes nothing.
+ ***************************************************************************/
+
+#ifndef __KMA_MAG_H__
+#define __KMA_MAG_H__
+
+#ifdef KMA_MAGAZINE
+
+/************System include***********************************************/
+
+/************Private include**********************************************/
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// number of size classes the layer can track
+#define MAGCLASSES 40
+
+#ifndef __KMA_MAG_IMPL__
+#define kma_malloc backendMalloc
+#define kma_free backendFree
+#define kma_stats backendStats
+#endif
+
+/************Function Prototypes******************************************/
+
+/***********************************************************************
+ *  Title: Backend allocation
+ * ---------------------------------------------------------------------
+ *    Purpose: The algorithm's own kma_malloc/kma_free, used by the
+ *             magazine layer on a miss and to allocate magazines
+ ***********************************************************************/
+void* backendMalloc(kma_size_t size);
+void backendFree(void* ptr, kma_size_t size);
+
+/***********************************************************************
+ *  Title: Size class of a request
+ * ---------------------------------------------------------------------
+ *    Purpose: Defined by the algorithm. Two requests may share cached
+ *             objects if and only if they map to the same class
+ *    Input: the request size
+ *    Output: the class (0 <= class < MAGCLASSES) or -1 if requests
+ *            of this size must not be cached
+ ***********************************************************************/
+int magClass(kma_size_t size);
+
+#endif // KMA_MAGAZINE
+
+#endif /* __KMA_MAG_H__ */
@@ -50,24 +50,266 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+
+// smallest bucket is 16 bytes so that a free buffer can hold its links
+#define MINBUCKET 4
+// largest bucket carved out of a page, larger requests get a whole page
+#define MAXBUCKET 12
+// bucket index recorded for pages handed out whole
+#define PAGEBUCKET 13
+
+// free buffer, the link is only valid while the buffer is free
+typedef struct buffer_struct
+{
+	struct buffer_struct* next;
+} buffer;
+
+// per-page usage entry (kmemusage), indexed by page_index()
+typedef struct pageUsage_struct
+{
+	kma_page_t* page;
+	// bucket index of the buffers on this page, 0 while unused
+	short index;
+	// number of buffers on this page currently allocated
+	short used;
+	// buffers from the start of the page that were ever handed out,
+	// the rest of the page is carved one buffer at a time
+	short carved;
+	// freed buffers of this page
+	buffer* free;
+	// neighbours on the partial list of the bucket
+	struct pageUsage_struct* prev;
+	struct pageUsage_struct* next;
+} pageUsage;
+
+// pages of one power-of-two size
+typedef struct
+{
+	int size;
+	// pages with both used and free buffers, full pages are on no list
+	pageUsage* partial;
+	// one empty page kept for reuse, NULL if none
+	pageUsage* empty;
+} bucket;
+
 /************Global Variables*********************************************/
+bucket buckets[MAXBUCKET + 1];
+pageUsage kmemusage[MAXPAGES];
+// buffers in use over all buckets
+int occupy = 0;
 
 /************Function Prototypes******************************************/
+// find the bucket index for a request size
+int bucketIndex(kma_size_t size);
+// set up a new page for the given bucket
+pageUsage* fillBucket(int index);
+// give an empty page back to the page layer
+void releasePage(pageUsage* entry);
+// push a page on the partial list of its bucket
+void linkPage(bucket* list, pageUsage* entry);
+// take a page off the partial list of its bucket
+void unlinkPage(bucket* list, pageUsage* entry);
 
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
 
+/**
+ * allocate memory
+ **/
 void*
 kma_malloc(kma_size_t size)
 {
-  return NULL;
+	// if the requested size is greater than a page, ignore it
+	if (size > PAGESIZE)
+	{
+		return NULL;
+	}
+
+	int index = bucketIndex(size);
+	// large request, hand out a whole page without any header
+	if (index > MAXBUCKET)
+	{
+		kma_page_t* page = get_page();
+		pageUsage* entry = &kmemusage[page_index(page->ptr)];
+		entry->page = page;
+		entry->index = PAGEBUCKET;
+		entry->used = 1;
+		return page->ptr;
+	}
+
+	bucket* list = &buckets[index];
+	pageUsage* entry = list->partial;
+	if (!entry)
+	{
+		// the cached empty page before a new one
+		entry = list->empty;
+		if (entry)
+		{
+			list->empty = NULL;
+		}
+		else
+		{
+			entry = fillBucket(index);
+		}
+		linkPage(list, entry);
+	}
+	// freed buffers before ones never handed out
+	buffer* buf = entry->free;
+	if (buf)
+	{
+		entry->free = buf->next;
+	}
+	else
+	{
+		buf = (buffer*)(entry->page->ptr + entry->carved * list->size);
+		entry->carved++;
+	}
+	entry->used++;
+	occupy++;
+	// a full page leaves the partial list until a buffer comes back
+	if (entry->used == PAGESIZE / list->size)
+	{
+		unlinkPage(list, entry);
+	}
+	return (void*)buf;
 }
 
+/**
+ * find the bucket index for a request size
+ **/
+int bucketIndex(kma_size_t size)
+{
+	int index = MINBUCKET;
+	while ((1 << index) < size)
+	{
+		index++;
+	}
+	return index;
+}
+
+/**
+ * set up a new page for the given bucket, its buffers are carved as
+ * they are handed out
+ **/
+pageUsage* fillBucket(int index)
+{
+	bucket* list = &buckets[index];
+	kma_page_t* page = get_page();
+	pageUsage* entry = &kmemusage[page_index(page->ptr)];
+	entry->page = page;
+	entry->index = index;
+	entry->used = 0;
+	entry->carved = 0;
+	entry->free = NULL;
+	list->size = 1 << index;
+	return entry;
+}
+
+/**
+ * push a page on the partial list of its bucket
+ **/
+void linkPage(bucket* list, pageUsage* entry)
+{
+	entry->prev = NULL;
+	entry->next = list->partial;
+	if (entry->next)
+	{
+		entry->next->prev = entry;
+	}
+	list->partial = entry;
+}
+
+/**
+ * take a page off the partial list of its bucket
+ **/
+void unlinkPage(bucket* list, pageUsage* entry)
+{
+	if (entry->prev)
+	{
+		entry->prev->next = entry->next;
+	}
+	else
+	{
+		list->partial = entry->next;
+	}
+	if (entry->next)
+	{
+		entry->next->prev = entry->prev;
+	}
+}
+
+/**
+ * give an empty page back to the page layer
+ **/
+void releasePage(pageUsage* entry)
+{
+	free_page(entry->page);
+	entry->page = NULL;
+	entry->index = 0;
+}
+
+/**
+ * free memory
+ **/
 void
 kma_free(void* ptr, kma_size_t size)
 {
-  ;
+	// the size comes from the kmemusage table, so no header is needed
+	pageUsage* entry = &kmemusage[page_index(ptr)];
+	assert(entry->index >= MINBUCKET && entry->used > 0);
+
+	if (entry->index == PAGEBUCKET)
+	{
+		free_page(entry->page);
+		entry->page = NULL;
+		entry->index = 0;
+		entry->used = 0;
+		return;
+	}
+
+	bucket* list = &buckets[entry->index];
+	// a full page has a free buffer again
+	if (entry->used == PAGESIZE / list->size)
+	{
+		linkPage(list, entry);
+	}
+	buffer* buf = (buffer*)ptr;
+	buf->next = entry->free;
+	entry->free = buf;
+	entry->used--;
+	occupy--;
+
+	// the page is empty again, cache it or give it back
+	if (entry->used == 0)
+	{
+		unlinkPage(list, entry);
+		if (!list->empty)
+		{
+			// carved again from the start once it is reused
+			entry->free = NULL;
+			entry->carved = 0;
+			list->empty = entry;
+		}
+		else
+		{
+			releasePage(entry);
+		}
+	}
+
+	// if there is no buffer allocated at all, free the cached pages too
+	if (occupy == 0)
+	{
+		int i;
+		for (i = MINBUCKET; i <= MAXBUCKET; i++)
+		{
+			if (buckets[i].empty)
+			{
+				releasePage(buckets[i].empty);
+				buckets[i].empty = NULL;
+			}
+		}
+	}
 }
 
 #endif // KMA_MCK2
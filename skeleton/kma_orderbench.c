@@ -0,0 +1,158 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Per size micro-benchmark for the kernel memory allocator
+ *    Author: Jin Sun, Yuchao Zhou
+ *    Copyright: 2014 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  For every power of two from 16 bytes to a page, the driver allocates
+ *  a batch of blocks of that size and frees them again, many times in
+ *  a row, and prints the cost of one kma_malloc or kma_free. With a
+ *  buddy allocator every size lands in its own order. One small block
+ *  stays allocated during the whole run so that the algorithm does not
+ *  give all pages back between rounds. It is linked instead of kma.c,
+ *  see the orderbench target in the Makefile.
+ ***************************************************************************/
+#define __KMA_TEST_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// blocks allocated before they are freed again
+#define BATCH 64
+// smallest and largest request size, as powers of two
+#define MINSHIFT 4
+#define MAXSHIFT 13
+
+// unit of ticks()
+#if defined(__x86_64__) || defined(__i386__)
+#define TICKNAME "cycles"
+#else
+#define TICKNAME "ns"
+#endif
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+void usage();
+void error(char*, char*);
+unsigned long long ticks();
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+char *name = NULL;
+
+int
+main(int argc, char* argv[])
+{
+  int rounds = 1000;
+  int shift, round, i;
+  void* ptrs[BATCH];
+
+  name = argv[0];
+
+  if (argc > 2)
+    {
+      usage();
+    }
+  if (argc == 2)
+    {
+      rounds = atoi(argv[1]);
+    }
+
+  void* pin = kma_malloc(1);
+  assert(pin != NULL);
+
+  printf("%8s %12s\n", "size", TICKNAME "/op");
+  for (shift = MINSHIFT; shift <= MAXSHIFT; shift++)
+    {
+      int size = 1 << shift;
+
+      // warm up, this also fetches the pages the batch needs
+      for (i = 0; i < BATCH; i++)
+	{
+	  ptrs[i] = kma_malloc(size);
+	}
+      if (ptrs[0] == NULL)
+	{
+	  printf("%8d %12s\n", size, "-");
+	  continue;
+	}
+      for (i = 0; i < BATCH; i++)
+	{
+	  kma_free(ptrs[i], size);
+	}
+
+      unsigned long long begin = ticks();
+      for (round = 0; round < rounds; round++)
+	{
+	  for (i = 0; i < BATCH; i++)
+	    {
+	      ptrs[i] = kma_malloc(size);
+	    }
+	  for (i = 0; i < BATCH; i++)
+	    {
+	      kma_free(ptrs[i], size);
+	    }
+	}
+      unsigned long long elapsed = ticks() - begin;
+
+      printf("%8d %12.1f\n", size,
+	     (double) elapsed / (2.0 * BATCH * rounds));
+    }
+
+  kma_free(pin, 1);
+  return 0;
+}
+
+/*
+ * cycle counter where the machine has one, nanoseconds otherwise
+ */
+#if defined(__x86_64__) || defined(__i386__)
+unsigned long long
+ticks()
+{
+  return __rdtsc();
+}
+#else
+unsigned long long
+ticks()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+void
+usage() {
+  printf("Usage: %s [rounds]\n", name);
+  exit(0);
+}
+
+void
+error(char* message, char* arg ) {
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(-1);
+}
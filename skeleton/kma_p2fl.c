@@ -38,10 +38,14 @@
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
+#ifdef KMA_STATS
+#include <stdio.h>
+#endif
 
 /************Private include**********************************************/
 #include "kma_page.h"
 #include "kma.h"
+#include "kma_mag.h"
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -50,55 +54,97 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
-// buffer
+// buffer, head links the free buffers of a run and points to the
+// run while the buffer is in use
 typedef struct
 {
 	void* head;
 } buffer;
 
-typedef struct pages_struct
+#ifdef KMA_P2FL_HEADERLESS
+// a used buffer keeps no header, its run is found through pageClass
+#define HEADER 0
+#else
+#define HEADER sizeof(buffer)
+#endif
+
+// a run of pages carved into buffers of one size
+typedef struct span_struct
 {
 	kma_page_t* page;
-	struct pages_struct* next;
-} pages;
+	struct linkedList_struct* list;
+	// freed buffers of this run
+	buffer* bufferList;
+	// buffers from fresh up to limit were never handed out
+	void* fresh;
+	void* limit;
+	// buffers in use
+	int live;
+	// neighbours on the partial or empty list of the class
+	struct span_struct* prev;
+	struct span_struct* next;
+} span;
 
+// no buffer of the run is free
+#define SPANFULL(s) (!(s)->bufferList && (s)->fresh == (s)->limit)
 
 // free list 
-typedef struct
+typedef struct linkedList_struct
 {
 	int size;
-	int occupy;
-	pages* pageList;
-	buffer* bufferList;
+	// buffers are carved from runs of 2^order pages
+	int order;
+	// runs with both used and free buffers, full runs are on no list
+	span* partial;
+	// runs without a used buffer, kept for reuse
+	span* empty;
+	int emptyCount;
 } linkedList;
 
-// main list to track sets of free lists
-typedef struct
-{
-	linkedList ll32;
-	linkedList ll64;
-	linkedList ll128;
-	linkedList ll256;
-	linkedList ll512;
-	linkedList ll1024;
-	linkedList ll2048;
-	linkedList ll4096;
-	linkedList ll8192;
-	linkedList ll;
-	int occupy;
-} mainList;
+#ifdef KMA_P2FL_QUARTER
+// four size classes per doubling, 32 to 8192 bytes
+#define NCLASSES 33
+#else
+// powers of two, 32 to 8192 bytes
+#define NCLASSES 9
+#endif
+// largest run a size class is carved from (4 pages)
+#define MAXRUNORDER 2
+// empty runs a class keeps before it gives them back
+#ifndef P2FL_MAXEMPTY
+#define P2FL_MAXEMPTY 1
+#endif
 
 /************Global Variables*********************************************/
-kma_page_t* mainPage = NULL;
+linkedList lists[NCLASSES];
+// run descriptors, indexed by page_index() of the first page of the run
+span spans[MAXPAGES];
+// buffers in use over all classes
+int occupy = 0;
+// class for every 8 byte step of the buffer size
+unsigned char sizeToClass[PAGESIZE / 8 + 1];
+#ifdef KMA_P2FL_HEADERLESS
+// class of every page that belongs to a run, indexed by page_index()
+unsigned char pageClass[MAXPAGES];
+#endif
+
+#ifdef KMA_STATS
+int nspans = 0;
+int nreleased = 0;
+int nreused = 0;
+#endif
 /************Function Prototypes******************************************/
-// initialize the main page 
-void initPage(kma_page_t* page);
-// add buffer to the freelist
-void addBuffer(linkedList* list);
+// set up the size classes and the lookup table
+void initClasses();
+// carve a new run into buffers of the class
+span* addSpan(linkedList* list);
+// give a run back to the page layer
+void releaseSpan(span* s);
 // get buffer from the freelist
 void* getBuffer(linkedList* list);
-// add one page to the freelist
-void addPage(kma_page_t* page, linkedList* list);
+// partial/empty list helpers
+void linkSpan(span** head, span* s);
+void unlinkSpan(span** head, span* s);
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
@@ -106,74 +152,60 @@ void addPage(kma_page_t* page, linkedList* list);
 void*
 kma_malloc(kma_size_t size)
 {
-	// if mainPage not existed, call initPage to initialize it
-	if (!mainPage)
+	// larger than the largest free list, ignore it
+	if (size + HEADER > PAGESIZE)
 	{
-		mainPage = get_page();
-		initPage(mainPage);
+		return NULL;
 	}
-	
-	// mainPage can be use
-	mainList* main_list = mainPage->ptr;
-	linkedList* freeList = NULL;
-	void* point = NULL;
-	int totalSize = size + sizeof(buffer);
+	if (lists[0].size == 0)
+	{
+		initClasses();
+	}
+	int totalSize = size + HEADER;
 
 	// choose corresponding free list according to the size requested
-	if (totalSize <= 32)
-		freeList = &main_list->ll32;
-	else if (totalSize <= 64)
-		freeList = &main_list->ll64;
-	else if (totalSize <= 128)
-		freeList = &main_list->ll128;
-	else if (totalSize <= 256)
-		freeList = &main_list->ll256;
-	else if (totalSize <= 512)
-		freeList = &main_list->ll512;
-	else if (totalSize <= 1024)
-		freeList = &main_list->ll1024;
-	else if (totalSize <= 2048)
-		freeList = &main_list->ll2048;
-	else if (totalSize <= 4096)
-		freeList = &main_list->ll4096;
-	else if (totalSize <= 8192)
-		freeList = &main_list->ll8192;
-	
-	if (freeList)
-		point = getBuffer(freeList);
-	return point;
+	linkedList* freeList = &lists[sizeToClass[(totalSize + 7) / 8]];
+	return getBuffer(freeList);
 }
 
-// initialize the main page
-void initPage(kma_page_t* page)
+// set up the size classes and the lookup table
+void initClasses()
 {
-	mainList* main_list = mainPage->ptr;
-	
-	// initialize the mainList object
-	main_list->ll32 = (linkedList){32, 0, NULL, NULL};
-	main_list->ll64 = (linkedList){64, 0, NULL, NULL};
-	main_list->ll128 = (linkedList){128, 0, NULL, NULL};
-	main_list->ll256 = (linkedList){256, 0, NULL, NULL};
-	main_list->ll512 = (linkedList){512, 0, NULL, NULL};
-	main_list->ll1024 = (linkedList){1024, 0, NULL, NULL};
-	main_list->ll2048 = (linkedList){2048, 0, NULL, NULL};
-	main_list->ll4096 = (linkedList){4096, 0, NULL, NULL};
-	main_list->ll8192 = (linkedList){8192, 0, NULL, NULL};
-	main_list->ll = (linkedList){sizeof(pages) + sizeof(buffer), 0, NULL, NULL};
-	
-	// splite pages into buffer
-	int remainedSize = PAGESIZE - sizeof(mainList);
-	int bufferCounts = remainedSize / (sizeof(pages) + sizeof(buffer));
-	void* startPoint = page->ptr + sizeof(mainList);
-	int i;
-	buffer* bufferHead;
-	for (i = 0; i < bufferCounts; i++)
+	int i, step, size;
+
+	for (i = 0, size = 32; i < NCLASSES; i++)
 	{
-		bufferHead = (buffer*)(startPoint + i * (sizeof(pages) + sizeof(buffer)));
-		bufferHead->head = main_list->ll.bufferList;
-		main_list->ll.bufferList = bufferHead;
+		int classSize = size;
+#ifdef KMA_P2FL_QUARTER
+		// a quarter of the power of two below the size
+		size += 1 << (31 - __builtin_clz(size) - 2);
+#else
+		size *= 2;
+#endif
+		// smallest run that wastes at most an eighth, else the best one
+		int order, best = 0;
+		for (order = 0; order <= MAXRUNORDER; order++)
+		{
+			int run = PAGESIZE << order;
+			if ((run % classSize) * 8 <= run)
+			{
+				best = order;
+				break;
+			}
+			if ((run % classSize) * (PAGESIZE << best) <
+			    ((PAGESIZE << best) % classSize) * run)
+				best = order;
+		}
+		lists[i] = (linkedList){classSize, best, NULL, NULL, 0};
+	}
+	assert(lists[NCLASSES - 1].size == PAGESIZE);
+
+	for (i = 0, step = 0; step <= PAGESIZE / 8; step++)
+	{
+		if (step * 8 > lists[i].size)
+			i++;
+		sizeToClass[step] = i;
 	}
-	addPage(page, &main_list->ll);
 }
 
 /*
@@ -181,52 +213,123 @@ void initPage(kma_page_t* page)
  */
 void* getBuffer(linkedList* list)
 {
-	// if no buffer at all, add one and return
-	if (!list->bufferList)
+	span* s = list->partial;
+	if (!s)
+	{
+		// a cached empty run before a new one
+		s = list->empty;
+		if (s)
+		{
+			unlinkSpan(&list->empty, s);
+			list->emptyCount--;
+#ifdef KMA_STATS
+			nreused++;
+#endif
+		}
+		else
+		{
+			s = addSpan(list);
+		}
+		linkSpan(&list->partial, s);
+	}
+	// choose one buffer to assign, freed ones before fresh ones
+	buffer* buf = s->bufferList;
+	if (buf)
 	{
-		addBuffer(list);
+		s->bufferList = (buffer*)buf->head;
 	}
-	// choose one buffer to assign
-	list->occupy++;
-	buffer* buf = list->bufferList;
-	list->bufferList = (buffer*)buf->head;
-	buf->head = (void*)list;
-	mainList* mainlist = mainPage->ptr;
-	if (list != &mainlist->ll)
-		mainlist->occupy++;
-	void* bufferPoint = (void*)buf + sizeof(buffer);
+	else
+	{
+		buf = (buffer*)s->fresh;
+		s->fresh += list->size;
+	}
+#ifndef KMA_P2FL_HEADERLESS
+	buf->head = (void*)s;
+#endif
+	s->live++;
+	occupy++;
+	// a full run leaves the partial list until a buffer comes back
+	if (SPANFULL(s))
+	{
+		unlinkSpan(&list->partial, s);
+	}
+	void* bufferPoint = (void*)buf + HEADER;
 	return bufferPoint;
 }
 
 /*
- * add buffer to the free list
+ * carve a new run into buffers of the class
  */
-void addBuffer(linkedList* list)
+span* addSpan(linkedList* list)
 {
-	kma_page_t* page = get_page();
-	void* pagePoint = page->ptr;
+	kma_page_t* page = get_pages(list->order);
+	int index = page_index(page->ptr);
+	span* s = &spans[index];
+	int bufferCount = page->size / list->size;
+#ifdef KMA_P2FL_HEADERLESS
 	int i;
-	int bufferCount = PAGESIZE / list->size;
-	// add buffer in the linked list
-	for (i = 0; i < bufferCount; i++)
+	for (i = 0; i < (1 << list->order); i++)
 	{
-		buffer* buf = (buffer*)(pagePoint + i * list->size);
-		buf->head = list->bufferList;
-		list->bufferList = buf;
+		pageClass[index + i] = list - lists;
 	}
-	addPage(page, list);
+#endif
+
+	s->page = page;
+	s->list = list;
+	s->bufferList = NULL;
+	// buffers are carved one at a time as they are handed out
+	s->fresh = page->ptr;
+	s->limit = page->ptr + bufferCount * list->size;
+	s->live = 0;
+#ifdef KMA_STATS
+	nspans++;
+#endif
+	return s;
 }
 
 /*
- * add page to the free list
+ * give a run back to the page layer
  */
-void addPage(kma_page_t* page, linkedList* list)
+void releaseSpan(span* s)
 {
-	mainList* mainlist = (mainList*)mainPage->ptr;
-	pages* pagelist = (pages*)getBuffer(&mainlist->ll);
-	pagelist->page = page;
-	pagelist->next = list->pageList;
-	list->pageList = pagelist;
+	free_page(s->page);
+	s->page = NULL;
+#ifdef KMA_STATS
+	nreleased++;
+#endif
+}
+
+/*
+ * push a run on a partial or empty list
+ */
+void linkSpan(span** head, span* s)
+{
+	s->prev = NULL;
+	s->next = *head;
+	if (s->next)
+	{
+		s->next->prev = s;
+	}
+	*head = s;
+}
+
+/*
+ * take a run off a partial or empty list
+ */
+void unlinkSpan(span** head, span* s)
+{
+	if (s->prev)
+	{
+		s->prev->next = s->next;
+	}
+	else
+	{
+		*head = s->next;
+	}
+	if (s->next)
+	{
+		s->next->prev = s->prev;
+	}
 }
 
 /*
@@ -235,38 +338,78 @@ void addPage(kma_page_t* page, linkedList* list)
 void
 kma_free(void* ptr, kma_size_t size)
 {
-	buffer* buf = (buffer*)((void*)ptr - sizeof(buffer));
-	linkedList* list = (linkedList*)buf->head;
-	buf->head = list->bufferList;
-	list->bufferList = buf;
-	list->occupy--;
-	// if there is no memory allocated in the linked list, then free that page
-	if (list->occupy == 0)
+	buffer* buf = (buffer*)((void*)ptr - HEADER);
+#ifdef KMA_P2FL_HEADERLESS
+	// runs are aligned to their size, so the run starts at the index
+	// rounded down to the run length of the page's class
+	int index = page_index(ptr);
+	span* s = &spans[index & ~((1 << lists[pageClass[index]].order) - 1)];
+#else
+	span* s = (span*)buf->head;
+#endif
+	linkedList* list = s->list;
+	// a full run has a free buffer again
+	if (SPANFULL(s))
+	{
+		linkSpan(&list->partial, s);
+	}
+	buf->head = s->bufferList;
+	s->bufferList = buf;
+	s->live--;
+	occupy--;
+	// the run is empty, cache it or give it back
+	if (s->live == 0)
 	{
-		list->bufferList = NULL;
-		pages* page = list->pageList;
-		while (page)
+		unlinkSpan(&list->partial, s);
+		if (list->emptyCount < P2FL_MAXEMPTY)
 		{
-			free_page(page->page);
-			page = page->next;
+			linkSpan(&list->empty, s);
+			list->emptyCount++;
+		}
+		else
+		{
+			releaseSpan(s);
 		}
-		list->pageList = NULL;
 	}
 
-	mainList* mainlist = (mainList*) mainPage->ptr;
-	mainlist->occupy--;
-	// if there is no memory allocated in the mainPage, then free the mainPage
-	if (mainlist->occupy == 0)
+	// if there is no memory allocated at all, free the cached runs too
+	if (occupy == 0)
 	{
-		pages* page = mainlist->ll.pageList;
-		while (page->next)
+		int i;
+		for (i = 0; i < NCLASSES; i++)
 		{
-			free_page(page->page);
-			page = page->next;
+			while (lists[i].empty)
+			{
+				span* e = lists[i].empty;
+				unlinkSpan(&lists[i].empty, e);
+				releaseSpan(e);
+			}
+			lists[i].emptyCount = 0;
 		}
-		free_page(page->page);
-		mainPage = NULL;
 	}
 }
 
+#ifdef KMA_MAGAZINE
+/*
+ * size class for the magazine layer, the index of the free list
+ */
+int magClass(kma_size_t size)
+{
+	int totalSize = size + HEADER;
+	if (totalSize > PAGESIZE)
+		return -1;
+	if (lists[0].size == 0)
+		initClasses();
+	return sizeToClass[(totalSize + 7) / 8];
+}
+#endif
+
+#ifdef KMA_STATS
+void kma_stats()
+{
+	printf("runs fetched: %d released: %d empty reused: %d\n",
+	       nspans, nreleased, nreused);
+}
+#endif
+
 #endif // KMA_P2FL
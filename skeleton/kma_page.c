@@ -45,6 +45,7 @@
 #include <string.h>
 #include <strings.h>
 #include <stdio.h>
+#include <sys/mman.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -57,16 +58,118 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+// address space reserved for the pool
+#if MAXPAGES > SIZE_MAX / PAGESIZE
+#error "MAXPAGES pages do not fit in the address space"
+#endif
+#define POOLSIZE ((size_t) MAXPAGES * PAGESIZE)
+// pages made accessible at a time as the pool grows (2 MB, one huge page)
+#define COMMITPAGES 256
+
+// KMA_HUGETLB tries hugetlbfs pages first and implies KMA_HUGEPAGES
+#if defined(KMA_HUGETLB) && !defined(KMA_HUGEPAGES)
+#define KMA_HUGEPAGES
+#endif
+
+#ifdef KMA_HUGEPAGES
+// x86-64 huge page, the pool is aligned to it so that every commit
+// chunk can be backed by one
+#define HUGEPAGESIZE (2 << 20)
+#define POOLALIGN HUGEPAGESIZE
+#else
+// aligned to the largest run so that runs are naturally aligned
+#define POOLALIGN (PAGESIZE << MAXPAGEORDER)
+#endif
+// address of the page with index i
+#define PAGEADDR(i) (pool + (size_t) (i) * PAGESIZE)
+
+// free pages kept backed by memory: once more than POOL_HIGHWATER are
+// free, the highest go back to the kernel with madvise() until
+// POOL_LOWWATER are left
+#ifndef POOL_LOWWATER
+#define POOL_LOWWATER 256
+#endif
+#ifndef POOL_HIGHWATER
+#define POOL_HIGHWATER 1024
+#endif
+#if POOL_LOWWATER > POOL_HIGHWATER
+#error "POOL_LOWWATER must not be above POOL_HIGHWATER"
+#endif
+
+// the page bitmaps keep 64 pages per word, so a run may not be
+// longer than a word
+#if MAXPAGEORDER > 6
+#error "MAXPAGEORDER must be at most 6"
+#endif
+#define WORDPAGES 64
+#define SUMMARYWORDS (MAXPAGES / WORDPAGES / WORDPAGES)
+#define TOPWORDS ((SUMMARYWORDS + WORDPAGES - 1) / WORDPAGES)
+// word and bit of entry i in a bitmap
+#define WORD(i) ((i) / WORDPAGES)
+#define BIT(i) (1ULL << ((i) % WORDPAGES))
+
 /************Global Variables*********************************************/
 static kma_page_stat_t kma_page_stats = { 0, 0, 0, PAGESIZE };
 
 static void* pool = NULL;
-static void* next_free_page = NULL;
+// pages below this index are readable and writable
+static int committed_pages = 0;
+// pages from this index on were never handed out and are not touched
+static int next_fresh_page = 0;
+static int next_id = 0;
+// the state of the pages is kept in bitmaps outside the pool, so a
+// free page is not touched until it is handed out again
+// bit set for every used page
+static unsigned long long used_map[MAXPAGES / WORDPAGES];
+// bit set for every free page given back with madvise()
+static unsigned long long released_map[MAXPAGES / WORDPAGES];
+// free pages below next_fresh_page that are still backed by memory
+static int resident_free = 0;
+// bit w of run_map[order] is set if word w of used_map has a free
+// aligned run of 2^order pages, so a run is found without a page scan
+static unsigned long long run_map[MAXPAGEORDER + 1][SUMMARYWORDS];
+// bit s is set if run_map[0][s] is nonzero, so that with run_map[0]
+// the lowest free page is three bit scans away
+static unsigned long long top_map[TOPWORDS];
+// words of used_map changed since their run_map bits were computed,
+// brought up to date by findRun() so that single pages stay cheap;
+// run_map[0] and top_map are always up to date
+static unsigned long long dirty_map[SUMMARYWORDS];
+#ifdef KMA_PAGE_LIFO
+// free pages below next_fresh_page, most recently freed on top, and
+// the position of every page on the stack
+static int free_stack[MAXPAGES];
+static int stack_slot[MAXPAGES];
+static int stack_top = 0;
+#endif
+// bits at the start of every aligned run of 2^order pages in a word
+static const unsigned long long run_starts[7] =
+  {
+    0xffffffffffffffffULL, 0x5555555555555555ULL, 0x1111111111111111ULL,
+    0x0101010101010101ULL, 0x0001000100010001ULL, 0x0000000100000001ULL,
+    0x0000000000000001ULL
+  };
+// descriptors handed out by get_page(), a run uses its first page's
+static kma_page_t page_descs[MAXPAGES];
 
 /************Function Prototypes******************************************/
 void* allocPage();
+kma_page_t* describePages(int, int);
 void freePage(void*);
 void initPages();
+void takePage(int);
+void releasePages();
+void commitPages(int);
+void markUsed(int, unsigned long long);
+void markFree(int);
+int lowestFree();
+#ifdef KMA_PAGE_LIFO
+void stackPage(int);
+void unstackPage(int);
+#endif
+unsigned long long freeRuns(unsigned long long, int);
+void updateRuns(int);
+int findRun(int);
 
 /************External Declaration*****************************************/
 
@@ -75,34 +178,197 @@ void initPages();
 kma_page_t*
 get_page()
 {
-  static int id = 0;
   kma_page_t* res;
   
   kma_page_stats.num_requested++;
   kma_page_stats.num_in_use++;
   
-  res = (kma_page_t*) malloc(sizeof(kma_page_t));
-  res->id = id++;
-  res->size = kma_page_stats.page_size;
-  res->ptr = allocPage();
+  void* page = allocPage();
+  
+  assert(page != NULL);
   
-  assert(res->ptr != NULL);
+  res = describePages(page_index(page), 1);
   
   return res;	
 }
 
+void
+get_page_batch(int n, kma_page_t* pages[])
+{
+  int i = 0;
+  
+  assert(n >= 0);
+  
+  // a single page needs no batch
+  if (n == 1)
+    {
+      pages[0] = get_page();
+      return;
+    }
+  
+  if (pool == NULL)
+    {
+      initPages();
+    }
+  
+  kma_page_stats.num_requested += n;
+  kma_page_stats.num_in_use += n;
+  
+  while (i < n)
+    {
+#ifdef KMA_PAGE_LIFO
+      // most recently freed first, one page at a time
+      pages[i++] = describePages(page_index(allocPage()), 1);
+#else
+      int index = lowestFree();
+      int word;
+      unsigned long long free, take = 0;
+      
+      if (index < 0)
+	{
+	  error("error: all pages already allocated", "");
+	}
+      // the free pages of the lowest word that has one, as many as are
+      // still needed, with one update of the bitmaps
+      word = WORD(index);
+      for (free = ~used_map[word]; free != 0 && i < n; free &= free - 1)
+	{
+	  index = word * WORDPAGES + __builtin_ctzll(free);
+	  take |= free & -free;
+	  if (index < next_fresh_page)
+	    {
+	      if (released_map[word] & BIT(index))
+		{
+		  released_map[word] &= ~BIT(index);
+		}
+	      else
+		{
+		  resident_free--;
+		}
+	    }
+	  pages[i++] = describePages(index, 1);
+	}
+      // free pages from next_fresh_page on are taken in order
+      if (index >= next_fresh_page)
+	{
+	  next_fresh_page = index + 1;
+	}
+      markUsed(word, take);
+#endif
+    }
+  commitPages(next_fresh_page);
+}
+
+kma_page_t*
+get_pages(int order)
+{
+  int count = 1 << order;
+  int i, j;
+  kma_page_t* res;
+  
+  assert(order >= 0 && order <= MAXPAGEORDER);
+  
+  // a single page needs no search
+  if (order == 0)
+    {
+      return get_page();
+    }
+  
+  if (pool == NULL)
+    {
+      initPages();
+    }
+  
+  // first aligned run without a used page
+  i = findRun(order);
+  if (i < 0)
+    {
+      error("error: no free run of pages", "");
+    }
+  
+  for (j = 0; j < count; j++)
+    {
+      takePage(i + j);
+    }
+  
+  kma_page_stats.num_requested += count;
+  kma_page_stats.num_in_use += count;
+  
+  res = describePages(i, count);
+  
+  return res;
+}
+
 void
 free_page(kma_page_t* ptr)
 {
+  int i;
+  
   assert(ptr != NULL);
   assert(ptr->ptr != NULL);
-  assert(kma_page_stats.num_in_use > 0);
+  assert(kma_page_stats.num_in_use >= ptr->size / PAGESIZE);
   
-  kma_page_stats.num_freed++;
-  kma_page_stats.num_in_use--;
+  // a run goes back page by page
+  for (i = 0; i < ptr->size / PAGESIZE; i++)
+    {
+      kma_page_stats.num_freed++;
+      kma_page_stats.num_in_use--;
+      freePage(ptr->ptr + i * PAGESIZE);
+    }
+  ptr->ptr = NULL;
+  if (resident_free > POOL_HIGHWATER)
+    {
+      releasePages();
+    }
+}
+
+void
+free_page_batch(int n, kma_page_t* pages[])
+{
+  int i, j;
   
-  freePage(ptr->ptr);
-  free(ptr);
+  for (i = 0; i < n; i++)
+    {
+      int count;
+      
+      assert(pages[i] != NULL);
+      assert(pages[i]->ptr != NULL);
+      count = pages[i]->size / PAGESIZE;
+      assert(kma_page_stats.num_in_use >= count);
+      
+      // a run goes back page by page
+      for (j = 0; j < count; j++)
+	{
+	  freePage(pages[i]->ptr + j * PAGESIZE);
+	}
+      kma_page_stats.num_freed += count;
+      kma_page_stats.num_in_use -= count;
+      pages[i]->ptr = NULL;
+    }
+  // the watermark is checked once for the whole batch
+  if (resident_free > POOL_HIGHWATER)
+    {
+      releasePages();
+    }
+}
+
+void
+free_pages(void* ptr, int order)
+{
+  kma_page_t* run = page_of(ptr);
+  
+  assert(run->ptr == ptr && run->size == PAGESIZE << order);
+  free_page(run);
+}
+
+kma_page_t*
+page_of(void* ptr)
+{
+  kma_page_t* res = &page_descs[page_index(ptr)];
+  
+  assert(res->ptr == BASEADDR(ptr));
+  
+  return res;
 }
 
 kma_page_stat_t*
@@ -113,68 +379,352 @@ page_stats()
   return memcpy(&stats, &kma_page_stats, sizeof(kma_page_stat_t));
 }
 
+int
+page_index(void* ptr)
+{
+  assert(pool != NULL);
+  assert(BASEADDR(ptr) >= pool && BASEADDR(ptr) < pool + POOLSIZE);
+  
+  return (BASEADDR(ptr) - pool) / PAGESIZE;
+}
+
+/*
+ * fill in the descriptor of the count pages from index
+ */
+kma_page_t*
+describePages(int index, int count)
+{
+  kma_page_t* res = &page_descs[index];
+  
+  res->id = next_id++;
+  res->size = count * kma_page_stats.page_size;
+  res->ptr = PAGEADDR(index);
+  
+  return res;
+}
+
 void*
 allocPage()
 {
-  void* res;
+  int index;
   
   if (pool == NULL)
     {
       initPages();
     }
   
-  res = next_free_page;
-  
-  if (res == NULL)
+#ifdef KMA_PAGE_LIFO
+  // the most recently freed page, next_fresh_page if there is none
+  index = (stack_top > 0) ? free_stack[stack_top - 1] : lowestFree();
+#else
+  // the lowest free page, so that used pages stay packed at the bottom
+  // of the pool; it is next_fresh_page once no freed page is below it
+  index = lowestFree();
+#endif
+  if (index < 0)
     {
       error("error: all pages already allocated", "");
     }
+  takePage(index);
   
-  next_free_page = *((void**)next_free_page);
-  
-  assert(res != NULL);
+  return PAGEADDR(index);
+}
+
+void
+takePage(int index)
+{
+  assert(!(used_map[WORD(index)] & BIT(index)));
   
-  return res;
+  if (index >= next_fresh_page)
+    {
+      // never used pages a run skipped are not backed by memory, they
+      // count as released
+      for (; next_fresh_page < index; next_fresh_page++)
+	{
+	  released_map[WORD(next_fresh_page)] |= BIT(next_fresh_page);
+#ifdef KMA_PAGE_LIFO
+	  stackPage(next_fresh_page);
+#endif
+	}
+      next_fresh_page = index + 1;
+      commitPages(next_fresh_page);
+    }
+  else
+    {
+      if (released_map[WORD(index)] & BIT(index))
+	{
+	  released_map[WORD(index)] &= ~BIT(index);
+	}
+      else
+	{
+	  resident_free--;
+	}
+#ifdef KMA_PAGE_LIFO
+      unstackPage(index);
+#endif
+    }
+  markUsed(WORD(index), BIT(index));
 }
 
 void
 freePage(void* ptr)
 {
+  int index = page_index(ptr);
+  
   assert(ptr != NULL);
+  assert(used_map[WORD(index)] & BIT(index));
+  markFree(index);
+#ifdef KMA_PAGE_LIFO
+  stackPage(index);
+#endif
+  resident_free++;
+}
+
+/*
+ * give the highest free pages back to the kernel until POOL_LOWWATER
+ * free pages are left backed by memory; pages are handed out lowest
+ * first, so these are the ones least likely to be needed again
+ */
+void
+releasePages()
+{
+  int word;
+  
+  for (word = WORD(next_fresh_page - 1); resident_free > POOL_LOWWATER;
+       word--)
+    {
+      unsigned long long resident = ~used_map[word] & ~released_map[word];
+      
+      assert(word >= 0);
+      // pages from next_fresh_page on are free but were never used
+      if (word == WORD(next_fresh_page))
+	{
+	  resident &= BIT(next_fresh_page) - 1;
+	}
+      while (resident && resident_free > POOL_LOWWATER)
+	{
+	  int index = word * WORDPAGES + 63 - __builtin_clzll(resident);
+	  
+	  resident &= ~BIT(index);
+	  // splits a transparent huge page, and fails on a hugetlbfs
+	  // page, which then simply stays backed by memory
+	  madvise(PAGEADDR(index), PAGESIZE, MADV_DONTNEED);
+	  released_map[word] |= BIT(index);
+	  resident_free--;
+	}
+    }
+}
+
+void
+markUsed(int word, unsigned long long bits)
+{
+  used_map[word] |= bits;
+  if (used_map[word] == ~0ULL)
+    {
+      run_map[0][WORD(word)] &= ~BIT(word);
+      if (run_map[0][WORD(word)] == 0)
+	{
+	  top_map[WORD(WORD(word))] &= ~BIT(WORD(word));
+	}
+    }
+  dirty_map[WORD(word)] |= BIT(word);
+}
+
+void
+markFree(int index)
+{
+  int word = WORD(index);
+  
+  used_map[word] &= ~BIT(index);
+  run_map[0][WORD(word)] |= BIT(word);
+  top_map[WORD(WORD(word))] |= BIT(WORD(word));
+  dirty_map[WORD(word)] |= BIT(word);
+}
+
+/*
+ * index of the lowest free page, -1 if every page is used
+ */
+int
+lowestFree()
+{
+  int i;
+  
+  for (i = 0; i < TOPWORDS; i++)
+    {
+      if (top_map[i])
+	{
+	  int summary = i * WORDPAGES + __builtin_ctzll(top_map[i]);
+	  int word = summary * WORDPAGES
+	    + __builtin_ctzll(run_map[0][summary]);
+	  
+	  return word * WORDPAGES + __builtin_ctzll(~used_map[word]);
+	}
+    }
+  return -1;
+}
+
+#ifdef KMA_PAGE_LIFO
+void
+stackPage(int index)
+{
+  stack_slot[index] = stack_top;
+  free_stack[stack_top++] = index;
+}
+
+/*
+ * take a page off the stack, the top page fills its slot
+ */
+void
+unstackPage(int index)
+{
+  int top = free_stack[--stack_top];
   
-  *((void**)ptr) = next_free_page;
-  next_free_page = ptr;
+  free_stack[stack_slot[index]] = top;
+  stack_slot[top] = stack_slot[index];
+}
+#endif
+
+/*
+ * starts of the aligned runs of 2^order pages that are all free in a
+ * word of the used bitmap
+ */
+unsigned long long
+freeRuns(unsigned long long used, int order)
+{
+  int shift;
   
-  if (kma_page_stats.num_in_use == 0)
+  // afterwards bit i is set if any of the 2^order pages from i is used
+  for (shift = 1; shift < (1 << order); shift <<= 1)
     {
-      free(pool);
-      pool = NULL;
-      next_free_page = NULL;
+      used |= used >> shift;
     }
+  return ~used & run_starts[order];
+}
+
+void
+updateRuns(int word)
+{
+  unsigned long long used = used_map[word];
+  unsigned long long bit = BIT(word);
+  int order;
+  
+  // order 0 is kept up to date by markUsed() and markFree()
+  for (order = 1; order <= MAXPAGEORDER; order++)
+    {
+      unsigned long long* summary = &run_map[order][WORD(word)];
+      
+      // used covers 2^order pages from every bit, see freeRuns()
+      used |= used >> (1 << (order - 1));
+      *summary = (*summary & ~bit)
+	| (-(unsigned long long) ((~used & run_starts[order]) != 0) & bit);
+    }
+}
+
+/*
+ * index of the lowest free aligned run of 2^order pages, -1 if none
+ */
+int
+findRun(int order)
+{
+  int i;
+  
+  for (i = 0; i < SUMMARYWORDS; i++)
+    {
+      while (dirty_map[i])
+	{
+	  int word = i * WORDPAGES + __builtin_ctzll(dirty_map[i]);
+	  
+	  dirty_map[i] &= dirty_map[i] - 1;
+	  updateRuns(word);
+	}
+      if (run_map[order][i])
+	{
+	  int word = i * WORDPAGES + __builtin_ctzll(run_map[order][i]);
+	  
+	  return word * WORDPAGES
+	    + __builtin_ctzll(freeRuns(used_map[word], order));
+	}
+    }
+  return -1;
 }
 
 void
 initPages()
 {
+  void* reserved;
   int i;
   
-  assert(next_free_page == NULL);
   assert(pool == NULL);
   
-  //pool = calloc(MAXPAGES, PAGESIZE);
-  int result = posix_memalign(&pool, PAGESIZE, MAXPAGES * PAGESIZE);
-  if(result)
-    error("Error using posix_memalign to allocate memory", "");
-  next_free_page = pool;
+  // reserve address space only, pages become usable in commitPages();
+  // the pool stays for the life of the process, freed pages beyond the
+  // watermarks are given back with madvise() instead
+  reserved = mmap(NULL, POOLSIZE + POOLALIGN, PROT_NONE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (reserved == MAP_FAILED)
+    {
+      error("Error using mmap to reserve the page pool", "");
+    }
+  pool = (void*) (((size_t) reserved + POOLALIGN - 1)
+		  & ~((size_t) POOLALIGN - 1));
+#ifdef KMA_HUGEPAGES
+  // ask for transparent huge pages, without THP support in the kernel
+  // this fails and the pool keeps ordinary pages
+  madvise(pool, POOLSIZE, MADV_HUGEPAGE);
+#endif
+  // no page is used, every word has runs of every order
+  memset(run_map, 0xff, sizeof(run_map));
+  for (i = 0; i < SUMMARYWORDS; i++)
+    {
+      top_map[WORD(i)] |= BIT(i);
+    }
+  // pages are handed out from the bottom as they are needed, so the
+  // pool is only touched (and backed by memory) where it is used
+  next_fresh_page = 0;
+  committed_pages = 0;
+}
+
+void
+commitPages(int end)
+{
+  int start = committed_pages;
   
-  // use ptr to point to the next free page struct
-  for (i = 0; i < (MAXPAGES - 1); i++)
+  if (end <= start)
+    {
+      return;
+    }
+  committed_pages = (end + COMMITPAGES - 1) / COMMITPAGES * COMMITPAGES;
+  if (committed_pages > MAXPAGES)
     {
-      void* ptr = (pool + i * PAGESIZE);
-      void* next = ptr + PAGESIZE;
+      committed_pages = MAXPAGES;
+    }
+#ifdef KMA_HUGETLB
+  // a hugetlbfs page per chunk if the system has one reserved, else an
+  // ordinary mapping that may still get a transparent huge page
+  for (; start < committed_pages; start += COMMITPAGES)
+    {
+      void* chunk = PAGEADDR(start);
       
-      *((void**) ptr) = next;
+      if (mmap(chunk, HUGEPAGESIZE, PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB,
+	       -1, 0) != MAP_FAILED)
+	{
+	  continue;
+	}
+      // a failed MAP_FIXED mapping may have dropped the reservation
+      if (mmap(chunk, HUGEPAGESIZE, PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE,
+	       -1, 0) == MAP_FAILED)
+	{
+	  error("Error using mmap to grow the page pool", "");
+	}
+      madvise(chunk, HUGEPAGESIZE, MADV_HUGEPAGE);
     }
-  
-  *((void**)(pool + (MAXPAGES - 1) * PAGESIZE)) = NULL;
+#else
+  if (mprotect(PAGEADDR(start), PAGEADDR(committed_pages) - PAGEADDR(start),
+	       PROT_READ | PROT_WRITE))
+    {
+      error("Error using mprotect to grow the page pool", "");
+    }
+#endif
 }
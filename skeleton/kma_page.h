@@ -45,6 +45,7 @@
 #define __KPAGE_H__
 
 /************System include***********************************************/
+#include <stdint.h>
 
 /************Private include**********************************************/
 
@@ -64,7 +65,16 @@
 
 #define PAGESIZE 8192
 
-#define MAXPAGES 4096
+// pages the pool can grow to, as address space that is only reserved:
+// 8 GB with 64-bit pointers, 256 MB where pointers are 32 bits wide
+#if UINTPTR_MAX > 0xffffffffUL
+#define MAXPAGES (1 << 20)
+#else
+#define MAXPAGES (1 << 15)
+#endif
+
+// largest run of contiguous pages, as a power of two (512 KB)
+#define MAXPAGEORDER 6
 
 /***********************************************************************
  *  Title: Base Address Macro
@@ -104,15 +114,59 @@ typedef struct
  ***********************************************************************/
 EXTERN kma_page_t* get_page();
 
+/***********************************************************************
+ *  Title: Allocates a run of memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates 2^order contiguous pages, aligned to the size
+ *             of the run. Each page counts as one page in the
+ *             statistics
+ *    Input: the order of the run (0 <= order <= MAXPAGEORDER)
+ *    Output: the run, its size is 2^order * PAGESIZE
+ ***********************************************************************/
+EXTERN kma_page_t* get_pages(int order);
+
+/***********************************************************************
+ *  Title: Allocates a batch of memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates n single pages at once, like n calls to
+ *             get_page(), but the pool bitmaps are updated once per
+ *             64 pages and the statistics once per batch. The pages
+ *             are the lowest free ones and need not be contiguous
+ *    Input: the number of pages and an array for n descriptors
+ *    Output: none, the descriptors are stored in pages
+ ***********************************************************************/
+EXTERN void get_page_batch(int n, kma_page_t* pages[]);
+
 /***********************************************************************
  *  Title: Releases a memory page 
  * ---------------------------------------------------------------------
- *    Purpose: Releases a memory page
+ *    Purpose: Releases a memory page or a run of pages
  *    Input: the pointer to the memory page structure
  *    Output: none
  ***********************************************************************/
 EXTERN void free_page(kma_page_t*);
 
+/***********************************************************************
+ *  Title: Releases a batch of memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases n pages or runs of pages at once, like n calls
+ *             to free_page(). The free pages kept backed by memory are
+ *             trimmed once for the whole batch
+ *    Input: the number of descriptors and the descriptors
+ *    Output: none
+ ***********************************************************************/
+EXTERN void free_page_batch(int n, kma_page_t* pages[]);
+
+/***********************************************************************
+ *  Title: Free a run of pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Give back the run get_pages(order) returned, by its
+ *             address, same as free_page() on its descriptor
+ *    Input: the first address of the run and its order
+ *    Output: none
+ ***********************************************************************/
+EXTERN void free_pages(void* ptr, int order);
+
 /***********************************************************************
  *  Title: Memory page statistics
  * ---------------------------------------------------------------------
@@ -122,6 +176,31 @@ EXTERN void free_page(kma_page_t*);
  ***********************************************************************/
 EXTERN kma_page_stat_t* page_stats();
 
+/***********************************************************************
+ *  Title: Page index
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the index of the page containing a pointer, counted
+ *             from the start of the page pool. Algorithms can use it
+ *             to keep per-page tables of MAXPAGES entries
+ *    Input: a pointer into an allocated page
+ *    Output: the page index (0 <= index < MAXPAGES)
+ ***********************************************************************/
+EXTERN int page_index(void*);
+
+/***********************************************************************
+ *  Title: Page descriptor of a pointer
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the descriptor get_page()/get_pages() returned for
+ *             the page or run that starts at BASEADDR(ptr), so an
+ *             algorithm need not store it. The descriptors live in a
+ *             table indexed by page_index() and stay valid until
+ *             free_page()
+ *    Input: a pointer into an allocated page, or into the first page
+ *           of an allocated run
+ *    Output: the page descriptor
+ ***********************************************************************/
+EXTERN kma_page_t* page_of(void*);
+
 /************External Declaration*****************************************/
 
 /**************Definition***************************************************/
@@ -37,6 +37,8 @@
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -48,29 +50,106 @@
  *  variables should be in all lower case. When initializing
  *  structures and arrays, line everything up in neat columns.
  */
-typedef struct
+
+// flags kept in the low bits of a boundary tag
+#define FREEBIT 0x1
+#define PREVFREEBIT 0x2
+#define SIZEMASK (~7L)
+
+#if defined(KMA_RM_BESTFIT) && defined(KMA_RM_NEXTFIT)
+#error "KMA_RM_BESTFIT and KMA_RM_NEXTFIT are exclusive"
+#endif
+
+typedef struct block_struct
 {
-	int size;
-	void* prev;
-	void* next;
+	// boundary tag, block size and flags, also kept by allocated blocks
+	long size;
+	// index links, only valid while the block is free
+	union
+	{
+		// address ordered list (first and next fit)
+		struct
+		{
+			void* prev;
+			void* next;
+		};
+		// size ordered treap (best fit)
+		struct
+		{
+			struct block_struct* left;
+			struct block_struct* right;
+		};
+	};
 } block;
 
-typedef struct
+// page directory entry, indexed by page_index()
+typedef struct pageEntry_struct
 {
-	// must be the first one, point to self, used in free_page()
-	void* self;
-	int pageCount;
+	kma_page_t* page;
+	// blocks allocated on the page
 	int blockCount;
+#ifndef KMA_RM_BESTFIT
+	// address ordered free blocks of this page
 	block* head;
-} pageHeader;
+	// pages with free blocks, in address order
+	struct pageEntry_struct* prev;
+	struct pageEntry_struct* next;
+#endif
+} pageEntry;
+
+// allocated blocks only keep their tag in front of the user data
+#define TAGSIZE (sizeof(long))
+// a free block also needs its links and a footer copy of the size
+#define MINBLOCK (sizeof(block) + TAGSIZE)
+// space for blocks on a page, nothing else is kept inside a page
+#define PAGEBLOCKS PAGESIZE
 
 /************Global Variables*********************************************/
-kma_page_t* mainPage = NULL;
+// every page in use, found through the block address
+pageEntry directory[MAXPAGES];
+#ifndef KMA_RM_BESTFIT
+// first page with free blocks
+pageEntry* firstPage = NULL;
+#ifdef KMA_RM_NEXTFIT
+// where the next search starts, survives across kma_malloc calls
+block* rover = NULL;
+#endif
+#else
+// free blocks ordered by size, then address
+block* root = NULL;
+#endif
+
+#ifdef KMA_STATS
+int listLength = 0;
+int peakLength = 0;
+long totalLength = 0;
+int nmallocs = 0;
+// free blocks looked at while searching
+long nscanned = 0;
+#endif
+
 /************Function Prototypes******************************************/
 void initPage(kma_page_t* page);
-void addEntry(void* entry, int size);
-block* firstFit(int size);
+// directory entry of the page a block is on
+pageEntry* pageOf(void* ptr);
+// find a free block of the given size and take it out of the index
+block* findFit(int size);
+// free block index, implemented by the list or the treap
+void addEntry(block* entry, int size);
 void deleteEntry(block* entry);
+void replaceEntry(block* entry, block* with, int size);
+void resizeEntry(block* entry, int size);
+// boundary tag helpers
+block* nextBlock(block* entry);
+void setFree(block* entry, int size);
+#if defined(KMA_RM_BESTFIT)
+block* bestFit(int size);
+#elif defined(KMA_RM_NEXTFIT)
+block* nextFit(int size);
+block* following(block* entry);
+#else
+block* firstFit(int size);
+#endif
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
@@ -82,23 +161,26 @@ void*
 kma_malloc(kma_size_t size)
 {
 	// if the requested size is greater than a page, ignore it
-	if ((size + sizeof(void*)) > PAGESIZE)
+	if ((size + TAGSIZE) > PAGEBLOCKS)
 	{
 		return NULL;
 	}
-	// if there are no allocated page, then initate the page
-	if (!mainPage)
-	{
-		mainPage = get_page();
-		initPage(mainPage);
-	}
+	// block size including the tag, kept a multiple of 8
+	int need = (size + TAGSIZE + 7) & SIZEMASK;
+	if (need < MINBLOCK)
+		need = MINBLOCK;
+#ifdef KMA_STATS
+	nmallocs++;
+	totalLength += listLength;
+	if (listLength > peakLength)
+		peakLength = listLength;
+#endif
 	// find suitable space
-	void* firstFit1 = firstFit(size);
-	pageHeader* base = BASEADDR(firstFit1);
+	block* fit = findFit(need);
 	// increase block count
-	base->blockCount++;
-	// return block address
-	return firstFit1;
+	pageOf(fit)->blockCount++;
+	// return address behind the tag
+	return (void*)fit + TAGSIZE;
 }
 
 /**
@@ -106,184 +188,477 @@ kma_malloc(kma_size_t size)
  **/
 void initPage(kma_page_t* page)
 {
-	// point page to itself to header can access it
-	*((kma_page_t**) page->ptr) = page;
-	pageHeader* header = (pageHeader*)(page->ptr);
+	pageEntry* entry = pageOf(page->ptr);
+	entry->page = page;
 	// initialize counters
-	header->pageCount = 0;
-	header->blockCount = 0;
-	// set linked list
-	header->head = (block*)((long int)header + sizeof(pageHeader));
-	// add space
-	addEntry(((void*)(header->head)), (PAGESIZE - sizeof(pageHeader)));
+	entry->blockCount = 0;
+#ifndef KMA_RM_BESTFIT
+	entry->head = NULL;
+#endif
+	// the whole page is one free block
+	addEntry((block*)page->ptr, PAGEBLOCKS);
 }
 
 /**
- * Add blocks on the page
- **/ 
-void addEntry(void* entry, int size)
+ * directory entry of the page a block is on
+ **/
+pageEntry* pageOf(void* ptr)
+{
+	return &directory[page_index(ptr)];
+}
+
+/**
+ * Find a block with the selected policy and split off what is not
+ * needed
+ **/
+block* findFit(int size)
 {
-	// initialize new block
-	((block*)entry)->size = size;
-	((block*)entry)->prev = NULL;
-	pageHeader* firstPage = (pageHeader*)(mainPage->ptr);
-	void* firstEntry = (void*)(firstPage->head);
-	
-	// insert into front of the linked list
-	if (entry < firstEntry)
+#if defined(KMA_RM_BESTFIT)
+	block* cursor = bestFit(size);
+#elif defined(KMA_RM_NEXTFIT)
+	block* cursor = nextFit(size);
+#else
+	block* cursor = firstFit(size);
+#endif
+	if (!cursor)
 	{
-		((block*)(firstPage->head))->prev = (block*)entry;
-		((block*)entry)->next = ((block*)(firstPage->head));
-		firstPage->head = (block*)entry;
-		return;
+		// no enough space, then add a new page
+		kma_page_t* newPage = get_page();
+		initPage(newPage);
+		return findFit(size);
 	}
-	// empty
-	else if (entry == firstEntry)
+
+	int cursorSize = cursor->size & SIZEMASK;
+	// perfect fit, the leftover could not hold a free block
+	if ((cursorSize - size) < MINBLOCK)
 	{
-		((block*)entry)->next = NULL;
-		return;
+		deleteEntry(cursor);
+		block* next = nextBlock(cursor);
+		if (next)
+			next->size &= ~PREVFREEBIT;
+		cursor->size = cursorSize;
 	}
-	// find position
+	// fit, the fragment takes the place of the block in the index
 	else
 	{
-		while (((block*)firstEntry)->next != NULL && entry > firstEntry)
+		replaceEntry(cursor, (block*)((void*)cursor + size), cursorSize - size);
+		cursor->size = size;
+	}
+	return cursor;
+}
+
+/**
+ * The block physically behind entry, NULL at the end of the page
+ **/
+block* nextBlock(block* entry)
+{
+	void* next = (void*)entry + (entry->size & SIZEMASK);
+	if (next >= BASEADDR(entry) + PAGESIZE)
+		return NULL;
+	return (block*)next;
+}
+
+/**
+ * Write the tags of a free block and tell the next block about it.
+ * The previous block is never free, free neighbours are merged
+ **/
+void setFree(block* entry, int size)
+{
+	entry->size = size | FREEBIT;
+	*((long*)((void*)entry + size - TAGSIZE)) = size;
+	block* next = nextBlock(entry);
+	if (next)
+		next->size |= PREVFREEBIT;
+}
+
+#ifndef KMA_RM_BESTFIT
+#ifndef KMA_RM_NEXTFIT
+/**
+ * Find first fit block, going through the pages in address order
+ **/
+block* firstFit(int size)
+{
+	pageEntry* page;
+	block* cursor;
+
+	for (page = firstPage; page; page = page->next)
+	{
+		for (cursor = page->head; cursor; cursor = cursor->next)
 		{
-			firstEntry = ((void*)(((block*)firstEntry)->next));
+#ifdef KMA_STATS
+			nscanned++;
+#endif
+			if ((cursor->size & SIZEMASK) >= size)
+				return cursor;
 		}
-		block* tmp = ((block*)firstEntry)->next;
-		if (tmp)
+	}
+	return NULL;
+}
+#else
+/**
+ * Find next fit block, the search starts where the last one ended
+ * and wraps around once
+ **/
+block* nextFit(int size)
+{
+	block* cursor = rover ? rover : (firstPage ? firstPage->head : NULL);
+	block* start = cursor;
+
+	while (cursor)
+	{
+#ifdef KMA_STATS
+		nscanned++;
+#endif
+		if ((cursor->size & SIZEMASK) >= size)
 		{
-			tmp->prev = entry;
+			// findFit takes it out, which moves the rover behind it
+			rover = cursor;
+			return cursor;
 		}
-		((block*)firstEntry)->next = entry;
-		((block*)entry)->prev = firstEntry;
-		((block*)entry)->next = tmp;
+		cursor = following(cursor);
+		if (cursor == start)
+			break;
 	}
+	return NULL;
 }
 
 /**
- * Find first fit block
+ * The free block after entry in address order, wrapping around at the
+ * last page
  **/
-block* firstFit(int size)
+block* following(block* entry)
 {
-	int minSize = sizeof(block);
-	if (size < minSize)
-		size = minSize;
-	pageHeader* header = (pageHeader*)(mainPage->ptr);
-	block* cursor = (block*)(header->head);
+	if (entry->next)
+		return entry->next;
+	pageEntry* page = pageOf(entry)->next;
+	return page ? page->head : firstPage->head;
+}
+#endif // KMA_RM_NEXTFIT
 
-	while (cursor)
+/**
+ * Add blocks to the free list of their page, kept in address order
+ **/ 
+void addEntry(block* entry, int size)
+{
+	pageEntry* page = pageOf(entry);
+	block* cursor = page->head;
+	block* last = NULL;
+
+	setFree(entry, size);
+	// first free block of the page, link the page in address order
+	if (!cursor)
 	{
-		// no enough size
-		if (cursor->size < size)
+		pageEntry* before = NULL;
+		pageEntry* after = firstPage;
+		while (after && after < page)
 		{
-			cursor = cursor->next;
-			continue;
+			before = after;
+			after = after->next;
 		}
-		// perfect fit
-		else if (cursor->size == size || (cursor->size - size) < minSize)
+		page->prev = before;
+		page->next = after;
+		if (after)
+			after->prev = page;
+		if (before)
+			before->next = page;
+		else
+			firstPage = page;
+	}
+	// find position
+	while (cursor && cursor < entry)
+	{
+		last = cursor;
+		cursor = cursor->next;
+	}
+	entry->prev = last;
+	entry->next = cursor;
+	if (cursor)
+		cursor->prev = entry;
+	if (last)
+		last->next = entry;
+	else
+		page->head = entry;
+#ifdef KMA_STATS
+	listLength++;
+#endif
+}
+
+/**
+ * Delete block
+ **/
+void deleteEntry(block* entry)
+{
+	pageEntry* page = pageOf(entry);
+	block* ptrPrev = entry->prev;
+	block* ptrNext = entry->next;
+
+#ifdef KMA_RM_NEXTFIT
+	// keep the rover on the list
+	if (rover == entry)
+	{
+		rover = following(entry);
+		if (rover == entry)
+			rover = NULL;
+	}
+#endif
+	if (ptrPrev)
+		ptrPrev->next = ptrNext;
+	else
+		page->head = ptrNext;
+	if (ptrNext)
+		ptrNext->prev = ptrPrev;
+	// no free blocks left on the page, unlink it
+	if (!page->head)
+	{
+		if (page->prev)
+			page->prev->next = page->next;
+		else
+			firstPage = page->next;
+		if (page->next)
+			page->next->prev = page->prev;
+	}
+#ifdef KMA_STATS
+	listLength--;
+#endif
+}
+
+/**
+ * Put a free block at the list position of another one, only used
+ * for physical neighbours so the list stays in address order
+ **/
+void replaceEntry(block* entry, block* with, int size)
+{
+	setFree(with, size);
+	with->prev = entry->prev;
+	with->next = entry->next;
+	if (with->prev)
+		((block*)(with->prev))->next = with;
+	else
+		pageOf(with)->head = with;
+	if (with->next)
+		((block*)(with->next))->prev = with;
+#ifdef KMA_RM_NEXTFIT
+	if (rover == entry)
+		rover = with;
+#endif
+}
+
+/**
+ * Change the size of a free block, its list position stays the same
+ **/
+void resizeEntry(block* entry, int size)
+{
+	setFree(entry, size);
+}
+
+#else
+/**
+ * Treap key order, by size and then by address
+ **/
+static inline int before(block* a, block* b)
+{
+	long sa = a->size & SIZEMASK;
+	long sb = b->size & SIZEMASK;
+	return sa < sb || (sa == sb && a < b);
+}
+
+/**
+ * Treap priority, a hash of the address so no field is needed
+ **/
+static inline unsigned int priority(block* entry)
+{
+	return (unsigned int)(((uintptr_t)entry >> 3) * 2654435761u);
+}
+
+/**
+ * Find the smallest block of at least size bytes
+ **/
+block* bestFit(int size)
+{
+	block* cursor = root;
+	block* best = NULL;
+
+	while (cursor)
+	{
+#ifdef KMA_STATS
+		nscanned++;
+#endif
+		if ((cursor->size & SIZEMASK) >= size)
 		{
-			deleteEntry(cursor);
-			return (void*)cursor;
+			best = cursor;
+			cursor = cursor->left;
 		}
-		// fit, add fragement to the linked list
 		else
 		{
-			addEntry((void*)((long int)cursor + size), (cursor->size - size));
-			deleteEntry(cursor);
-			return (void*)cursor;
+			cursor = cursor->right;
 		}
 	}
-	// no enough space, then add a new page
-	kma_page_t* newPage = get_page();
-	initPage(newPage);
-	header->pageCount++;
-	return firstFit(size);
+	return best;
 }
 
 /**
- * Delete block
+ * Insert a block into the treap
  **/
-void deleteEntry(block* entry)
+void addEntry(block* entry, int size)
 {
-	block* ptr = entry;
-	block* ptrPrev = ptr->prev;
-	block* ptrNext = ptr->next;
-	
-	// only one node
-	if ((!ptrPrev) && (!ptrNext))
+	block** link = &root;
+
+	setFree(entry, size);
+	// go down while the nodes have a higher priority
+	while (*link && priority(*link) >= priority(entry))
 	{
-		pageHeader* tmp = (pageHeader*)(mainPage->ptr);
-		tmp->head = NULL;
-		mainPage = NULL;
-		return;
+		link = before(entry, *link) ? &(*link)->left : &(*link)->right;
 	}
-	// delete the last node
-	else if (!ptrNext)
+	// split the rest of the subtree around the new node
+	block* cursor = *link;
+	block** less = &entry->left;
+	block** more = &entry->right;
+	while (cursor)
 	{
-		ptrPrev->next = NULL;
-		return;
+		if (before(cursor, entry))
+		{
+			*less = cursor;
+			less = &cursor->right;
+			cursor = cursor->right;
+		}
+		else
+		{
+			*more = cursor;
+			more = &cursor->left;
+			cursor = cursor->left;
+		}
 	}
-	// delete the first node
-	else if (!ptrPrev)
+	*less = NULL;
+	*more = NULL;
+	*link = entry;
+#ifdef KMA_STATS
+	listLength++;
+#endif
+}
+
+/**
+ * Remove a block from the treap
+ **/
+void deleteEntry(block* entry)
+{
+	block** link = &root;
+
+	while (*link != entry)
 	{
-		pageHeader* tmp = (pageHeader*)(mainPage->ptr);
-		ptrNext->prev = NULL;
-		tmp->head = ptrNext;
-		return;
+		assert(*link != NULL);
+		link = before(entry, *link) ? &(*link)->left : &(*link)->right;
 	}
-	else
+	// merge the two subtrees into the place of the node
+	block* less = entry->left;
+	block* more = entry->right;
+	while (less && more)
 	{
-		((block*)(ptr->prev))->next = ptr->next;
-		((block*)(ptr->next))->prev = ptr->prev;
-		return;
+		if (priority(less) >= priority(more))
+		{
+			*link = less;
+			link = &less->right;
+			less = less->right;
+		}
+		else
+		{
+			*link = more;
+			link = &more->left;
+			more = more->left;
+		}
 	}
+	*link = less ? less : more;
+#ifdef KMA_STATS
+	listLength--;
+#endif
 }
 
+/**
+ * Replace a free block with one of another size
+ **/
+void replaceEntry(block* entry, block* with, int size)
+{
+	deleteEntry(entry);
+	addEntry(with, size);
+}
+
+/**
+ * Change the size of a free block, its key changes with it
+ **/
+void resizeEntry(block* entry, int size)
+{
+	deleteEntry(entry);
+	addEntry(entry, size);
+}
+#endif // KMA_RM_BESTFIT
+
 /**
  * Free memory
  **/
 void
 kma_free(void* ptr, kma_size_t size)
 {
-	addEntry(ptr, size);
-	pageHeader* baseAdd = BASEADDR(ptr);
-	baseAdd->blockCount--;
-	pageHeader* firstPage = (pageHeader*)(mainPage->ptr);
-	int totalPages = firstPage->pageCount;
-	int count = 1;
-	pageHeader* lastPage;
-	// traverse the free list and free
-	for (; count; totalPages--)
+	block* entry = (block*)(ptr - TAGSIZE);
+	assert(!(entry->size & FREEBIT));
+	pageEntry* page = pageOf(ptr);
+	page->blockCount--;
+
+	int total = entry->size & SIZEMASK;
+	block* next = nextBlock(entry);
+	block* prev = NULL;
+	if (next && !(next->size & FREEBIT))
 	{
-		lastPage = ((pageHeader*)((long int)firstPage + totalPages * PAGESIZE));
-		count = 0;
-		if (lastPage->blockCount == 0)
-		{
-			count = 1;
-			block* tmp;
-			// delete buffer
-			for (tmp = firstPage->head; tmp != NULL; tmp = tmp->next)
-			{
-				if (BASEADDR(tmp) == lastPage)
-				{
-					deleteEntry(tmp);
-				}
-			}
-			count = 1;
-			// if there are only one main page
-			if (lastPage == firstPage)
-			{
-				count = 0;
-				mainPage = NULL;
-			}
-			free_page(lastPage->self);
-			if (mainPage)
-			{
-				firstPage->pageCount--;
-			}
-		}
+		next = NULL;
+	}
+	if (next)
+	{
+		total += next->size & SIZEMASK;
+	}
+	if (entry->size & PREVFREEBIT)
+	{
+		// the footer of the previous block holds its size
+		prev = (block*)((void*)entry - *((long*)((void*)entry - TAGSIZE)));
+		assert(prev->size & FREEBIT);
+		total += prev->size & SIZEMASK;
+	}
+
+	// the page is empty again, give it back
+	if (total == PAGEBLOCKS)
+	{
+		assert(page->blockCount == 0);
+		if (next)
+			deleteEntry(next);
+		if (prev)
+			deleteEntry(prev);
+		free_page(page->page);
+		page->page = NULL;
+		return;
+	}
+
+	// merge with the neighbours, the merged block keeps a slot if it can
+	if (prev)
+	{
+		if (next)
+			deleteEntry(next);
+		resizeEntry(prev, total);
+	}
+	else if (next)
+	{
+		replaceEntry(next, entry, total);
+	}
+	else
+	{
+		addEntry(entry, total);
 	}
 }
 
+#ifdef KMA_STATS
+void kma_stats()
+{
+	printf("free list length: avg %.1f peak %d\n",
+	       nmallocs ? (double)totalLength / nmallocs : 0.0, peakLength);
+	printf("blocks scanned per malloc: %.1f\n",
+	       nmallocs ? (double)nscanned / nmallocs : 0.0);
+}
+#endif
+
 #endif // KMA_RM
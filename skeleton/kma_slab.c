@@ -0,0 +1,379 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Kernel memory allocator based on the slab algorithm
+ *    Author: Jin Sun, Yuchao Zhou
+ *    Copyright: 2014 Northwestern University
+ ***************************************************************************/
+#ifdef KMA_SLAB
+#define __KMA_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+#include "kma_mag.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#define NCACHES 26
+// slab coloring step
+#define CACHELINE 64
+// empty slabs a cache keeps before giving pages back
+#define MAXEMPTY 1
+// most pages a cache fetches at once while it keeps running dry
+#ifndef SLAB_MAXGROW
+#define SLAB_MAXGROW 1
+#endif
+#if SLAB_MAXGROW < MAXEMPTY
+#error "SLAB_MAXGROW must not be below MAXEMPTY"
+#endif
+
+typedef struct slab_struct
+{
+	struct slab_struct* next;
+	struct slab_struct* prev;
+	struct cache_struct* owner;
+	kma_page_t* page;
+	// free objects, linked through their first word
+	void* freeList;
+	int inuse;
+} slab;
+
+typedef struct cache_struct
+{
+	int size;
+	// objects per slab
+	int count;
+	// bytes left over in a slab, the range of colors
+	int colorMax;
+	int colorNext;
+	// list heads, partial is kept sorted most-full first
+	slab partial;
+	slab full;
+	slab empty;
+	int emptyCount;
+	// pages fetched when the cache runs dry, doubled while it keeps
+	// running dry and halved as slabs empty; also the empty slabs kept
+	int grow;
+} cache;
+
+/************Global Variables*********************************************/
+// object sizes, picked so that they pack a page with little waste
+int cacheSizes[NCACHES] = { 16,   32,   48,   64,   80,   96,   112,
+			    128,  160,  192,  224,  256,  320,  384,
+			    448,  512,  640,  768,  896,  1024, 1360,
+			    1632, 2048, 2720, 4096, 8192 };
+cache caches[NCACHES];
+// cache index for every 16 byte step of the request size
+unsigned char sizeToCache[PAGESIZE / 16 + 1];
+// slab descriptors live off-slab, indexed by page_index()
+slab slabs[MAXPAGES];
+// objects handed out over all caches
+int used = 0;
+
+/************Function Prototypes******************************************/
+// set up the caches and the size lookup table
+void initCaches();
+// fetch a batch of pages for a cache, returns one new slab
+slab* growCache(cache* c);
+// set up a new slab for a cache on a page
+slab* newSlab(cache* c, kma_page_t* page);
+// give the page of an empty slab back
+void destroySlab(slab* s);
+// give all empty slabs of a cache back at once
+void emptyCache(cache* c);
+// list helpers
+void listInit(slab* head);
+void listRemove(slab* s);
+void listInsertAfter(slab* pos, slab* s);
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+/**
+ * allocate memory
+ **/
+void*
+kma_malloc(kma_size_t size)
+{
+	// if the requested size is greater than a page, ignore it
+	if (size > PAGESIZE)
+	{
+		return NULL;
+	}
+	if (caches[0].size == 0)
+	{
+		initCaches();
+	}
+
+	cache* c = &caches[sizeToCache[(size + 15) / 16]];
+	slab* s = c->partial.next;
+	if (s == &c->partial)
+	{
+		// no partial slab, reuse an empty one or grow the cache
+		if (c->empty.next != &c->empty)
+		{
+			s = c->empty.next;
+			listRemove(s);
+			c->emptyCount--;
+		}
+		else
+		{
+			s = growCache(c);
+		}
+		// a fresh slab is the least full one
+		listInsertAfter(c->partial.prev, s);
+	}
+
+	// take an object from the most full partial slab
+	void* obj = s->freeList;
+	s->freeList = *((void**)obj);
+	s->inuse++;
+	used++;
+	if (s->inuse == c->count)
+	{
+		listRemove(s);
+		listInsertAfter(&c->full, s);
+	}
+	return obj;
+}
+
+/**
+ * set up the caches and the size lookup table
+ **/
+void initCaches()
+{
+	int i, step;
+	for (i = 0; i < NCACHES; i++)
+	{
+		cache* c = &caches[i];
+		c->size = cacheSizes[i];
+		c->count = PAGESIZE / c->size;
+		c->colorMax = PAGESIZE - c->count * c->size;
+		c->colorNext = 0;
+		c->emptyCount = 0;
+		c->grow = MAXEMPTY;
+		listInit(&c->partial);
+		listInit(&c->full);
+		listInit(&c->empty);
+	}
+	for (i = 0, step = 0; step <= PAGESIZE / 16; step++)
+	{
+		if (step * 16 > cacheSizes[i])
+		{
+			i++;
+		}
+		sizeToCache[step] = i;
+	}
+}
+
+/**
+ * fetch c->grow pages in one batch, the slabs not returned wait on the
+ * empty list, so a burst of allocations does not go to the page layer
+ * for every page
+ **/
+slab* growCache(cache* c)
+{
+	kma_page_t* pages[SLAB_MAXGROW];
+	int n = c->grow;
+	int i;
+
+	c->grow = (2 * n < SLAB_MAXGROW) ? 2 * n : SLAB_MAXGROW;
+	if (n == 1)
+	{
+		return newSlab(c, get_page());
+	}
+	get_page_batch(n, pages);
+	for (i = 1; i < n; i++)
+	{
+		listInsertAfter(&c->empty, newSlab(c, pages[i]));
+		c->emptyCount++;
+	}
+	return newSlab(c, pages[0]);
+}
+
+/**
+ * set up a new slab for a cache on a page
+ **/
+slab* newSlab(cache* c, kma_page_t* page)
+{
+	slab* s = &slabs[page_index(page->ptr)];
+	s->owner = c;
+	s->page = page;
+	s->inuse = 0;
+	s->freeList = NULL;
+
+	// shift every new slab by one more cache line
+	void* first = page->ptr + c->colorNext;
+	c->colorNext += CACHELINE;
+	if (c->colorNext > c->colorMax)
+	{
+		c->colorNext = 0;
+	}
+
+	// link the objects so the lowest address is handed out first
+	int i;
+	for (i = c->count - 1; i >= 0; i--)
+	{
+		void* obj = first + i * c->size;
+		*((void**)obj) = s->freeList;
+		s->freeList = obj;
+	}
+	return s;
+}
+
+/**
+ * give the page of an empty slab back
+ **/
+void destroySlab(slab* s)
+{
+	listRemove(s);
+	s->owner->emptyCount--;
+	free_page(s->page);
+	s->owner = NULL;
+	s->page = NULL;
+}
+
+/**
+ * give all empty slabs of a cache back in one batch
+ **/
+void emptyCache(cache* c)
+{
+	kma_page_t* pages[SLAB_MAXGROW];
+	int n = 0;
+
+	assert(c->emptyCount <= SLAB_MAXGROW);
+	while (c->emptyCount > 0)
+	{
+		slab* s = c->empty.next;
+		listRemove(s);
+		c->emptyCount--;
+		pages[n++] = s->page;
+		s->owner = NULL;
+		s->page = NULL;
+	}
+	free_page_batch(n, pages);
+	c->grow = MAXEMPTY;
+}
+
+/**
+ * free memory
+ **/
+void
+kma_free(void* ptr, kma_size_t size)
+{
+	slab* s = &slabs[page_index(ptr)];
+	cache* c = s->owner;
+	assert(c != NULL && s->inuse > 0);
+
+	*((void**)ptr) = s->freeList;
+	s->freeList = ptr;
+	used--;
+
+	if (s->inuse == c->count)
+	{
+		// was full, now it is the most full partial slab
+		s->inuse--;
+		listRemove(s);
+		if (s->inuse == 0)
+		{
+			listInsertAfter(&c->empty, s);
+			c->emptyCount++;
+		}
+		else
+		{
+			listInsertAfter(&c->partial, s);
+		}
+	}
+	else if (--s->inuse == 0)
+	{
+		listRemove(s);
+		listInsertAfter(&c->empty, s);
+		c->emptyCount++;
+	}
+	else
+	{
+		// move the slab back until the list is sorted again
+		slab* pos = s;
+		while (pos->next != &c->partial && pos->next->inuse > s->inuse)
+		{
+			pos = pos->next;
+		}
+		if (pos != s)
+		{
+			listRemove(s);
+			listInsertAfter(pos, s);
+		}
+	}
+
+	// demand fell, fetch less next time and keep fewer empty slabs
+	if (c->emptyCount > c->grow)
+	{
+		if (c->grow > MAXEMPTY)
+		{
+			c->grow /= 2;
+		}
+		while (c->emptyCount > c->grow)
+		{
+			destroySlab(c->empty.prev);
+		}
+	}
+	// nothing allocated anymore, give all cached pages back
+	if (used == 0)
+	{
+		int i;
+		for (i = 0; i < NCACHES; i++)
+		{
+			emptyCache(&caches[i]);
+		}
+	}
+}
+
+#ifdef KMA_MAGAZINE
+/**
+ * size class for the magazine layer, the index of the cache
+ **/
+int magClass(kma_size_t size)
+{
+	if (size > PAGESIZE)
+	{
+		return -1;
+	}
+	if (caches[0].size == 0)
+	{
+		initCaches();
+	}
+	return sizeToCache[(size + 15) / 16];
+}
+#endif
+
+void listInit(slab* head)
+{
+	head->next = head;
+	head->prev = head;
+}
+
+void listRemove(slab* s)
+{
+	s->prev->next = s->next;
+	s->next->prev = s->prev;
+}
+
+void listInsertAfter(slab* pos, slab* s)
+{
+	s->prev = pos;
+	s->next = pos->next;
+	pos->next->prev = s;
+	pos->next = s;
+}
+
+#endif // KMA_SLAB
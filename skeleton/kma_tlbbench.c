@@ -0,0 +1,209 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Locality benchmark for the kernel memory allocator
+ *    Author: Jin Sun, Yuchao Zhou
+ *    Copyright: 2014 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  The driver replays a trace file like kma_bench.c, but uses the
+ *  memory it gets: every allocated buffer is written, every buffer is
+ *  read before it is freed, and every operation also reads one live
+ *  buffer picked at random. The data TLB misses of the replay are
+ *  counted with perf_event_open() and printed per operation, so the
+ *  page pool can be compared with and without -DKMA_HUGEPAGES. Where
+ *  the counters are not available only the time is printed. It is
+ *  linked instead of kma.c, see the tlbbench target in the Makefile.
+ ***************************************************************************/
+#define __KMA_TEST_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+#include "kma_trace.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+// open a data TLB miss counter for loads or stores, -1 if unavailable
+int openCounter(int op);
+long long readCounter(int fd);
+// anonymous memory of the process backed by transparent huge pages
+long hugeKB();
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  int n_req, n_ops, i, round;
+  int rounds = 1;
+  int n_live = 0;
+  unsigned int seed = 1;
+  volatile char sink = 0;
+
+  name = argv[0];
+
+  if (argc != 2 && argc != 3)
+    {
+      usage();
+    }
+  if (argc == 3)
+    {
+      rounds = atoi(argv[2]);
+    }
+
+  op_t* ops = readTrace(argv[1], &n_req, &n_ops);
+  char** ptrs = malloc(n_req * sizeof(char*));
+  int* sizes = malloc(n_req * sizeof(int));
+  // live requests, and the position of every request in live
+  int* live = malloc(n_req * sizeof(int));
+  int* slot = malloc(n_req * sizeof(int));
+  assert(ptrs != NULL && sizes != NULL && live != NULL && slot != NULL);
+
+  int loads = openCounter(PERF_COUNT_HW_CACHE_OP_READ);
+  int stores = openCounter(PERF_COUNT_HW_CACHE_OP_WRITE);
+
+  double begin = now();
+  long long loads0 = readCounter(loads);
+  long long stores0 = readCounter(stores);
+  for (round = 0; round < rounds; round++)
+    {
+      for (i = 0; i < n_ops; i++)
+	{
+	  op_t* op = &ops[i];
+
+	  if (op->type == OP_REQUEST)
+	    {
+	      char* ptr = kma_malloc(op->size);
+
+	      sizes[op->id] = op->size;
+	      ptrs[op->id] = ptr;
+	      // an empty buffer has no byte to touch
+	      if (ptr != NULL && op->size > 0)
+		{
+		  ptr[0] = 1;
+		  ptr[op->size - 1] = 1;
+		  slot[op->id] = n_live;
+		  live[n_live++] = op->id;
+		}
+	    }
+	  else if (ptrs[op->id] != NULL)
+	    {
+	      if (sizes[op->id] > 0)
+		{
+		  sink += ptrs[op->id][sizes[op->id] - 1];
+		  // the last live request takes the slot of the freed one
+		  live[slot[op->id]] = live[--n_live];
+		  slot[live[n_live]] = slot[op->id];
+		}
+	      kma_free(ptrs[op->id], sizes[op->id]);
+	    }
+
+	  if (n_live > 0)
+	    {
+	      seed = seed * 1103515245 + 12345;
+	      sink += ptrs[live[(seed >> 8) % n_live]][0];
+	    }
+	}
+    }
+  long long loadMisses = readCounter(loads) - loads0;
+  long long storeMisses = readCounter(stores) - stores0;
+  double elapsed = now() - begin;
+
+  printf("%s: %d ops, %.1f ns/op", argv[1], n_ops * rounds,
+	 elapsed * 1e9 / ((double) n_ops * rounds));
+  if (loads >= 0)
+    {
+      printf(", dTLB load misses/op %.3f",
+	     (double) loadMisses / ((double) n_ops * rounds));
+    }
+  if (stores >= 0)
+    {
+      printf(", dTLB store misses/op %.3f",
+	     (double) storeMisses / ((double) n_ops * rounds));
+    }
+  if (loads < 0 && stores < 0)
+    {
+      printf(", dTLB counters not available");
+    }
+  printf(", %ld KB in huge pages\n", hugeKB());
+
+  free(ops);
+  free(ptrs);
+  free(sizes);
+  free(live);
+  free(slot);
+  return 0;
+}
+
+/*
+ * data TLB misses of this process in user space, counting right away
+ */
+int
+openCounter(int op)
+{
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB | (op << 8)
+    | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+long long
+readCounter(int fd)
+{
+  long long count = 0;
+
+  if (fd >= 0 && read(fd, &count, sizeof(count)) != sizeof(count))
+    {
+      count = 0;
+    }
+  return count;
+}
+
+long
+hugeKB()
+{
+  FILE* f = fopen("/proc/self/smaps_rollup", "r");
+  char line[128];
+  long kb = 0;
+
+  if (f == NULL)
+    {
+      return 0;
+    }
+  while (fgets(line, sizeof(line), f) != NULL)
+    {
+      if (sscanf(line, "AnonHugePages: %ld", &kb) == 1)
+	{
+	  break;
+	}
+    }
+  fclose(f);
+  return kb;
+}
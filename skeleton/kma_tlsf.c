@@ -0,0 +1,301 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Kernel memory allocator based on two-level segregated fit
+ *    Author: Jin Sun, Yuchao Zhou
+ *    Copyright: 2014 Northwestern University
+ ***************************************************************************/
+#ifdef KMA_TLSF
+#define __KMA_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <stddef.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+// second level lists per power of two
+#define SLBITS 4
+#define SLCOUNT (1 << SLBITS)
+// block sizes are multiples of 8
+#define ALIGNSHIFT 3
+#define ALIGNMENT (1 << ALIGNSHIFT)
+// blocks below SMALLBLOCK all live in first level 0, spaced by ALIGNMENT
+#define FLSHIFT (SLBITS + ALIGNSHIFT)
+#define SMALLBLOCK (1 << FLSHIFT)
+// first levels up to a whole page (2^13)
+#define FLCOUNT (13 - FLSHIFT + 2)
+
+// flags kept in the low bits of the size word
+#define FREEBIT 0x1
+#define PREVFREEBIT 0x2
+#define SIZEMASK (~((size_t)ALIGNMENT - 1))
+
+// header of every block, the links are only valid while it is free
+typedef struct block_struct
+{
+	// block size including the header, low bits hold the flags
+	size_t size;
+	struct block_struct* next;
+	struct block_struct* prev;
+} block;
+
+// allocated blocks only carry the size word
+#define HEADER (sizeof(size_t))
+// a free block must hold its links and the footer (boundary tag)
+#define MINBLOCK (sizeof(block) + sizeof(size_t))
+
+/************Global Variables*********************************************/
+// first level bitmap, bit i is set if any list of level i is nonempty
+unsigned int flBitmap = 0;
+// second level bitmaps, one per first level
+unsigned int slBitmap[FLCOUNT];
+// segregated free lists
+block* freeLists[FLCOUNT][SLCOUNT];
+
+/************Function Prototypes******************************************/
+// map a block size to its first and second level index
+void mapping(size_t size, int* fl, int* sl);
+// find a free block of at least size bytes, NULL if there is none
+block* findSuitable(size_t size);
+// add a new page as one free block
+block* addPage();
+// free list helpers
+void insertBlock(block* b);
+void removeBlock(block* b);
+// boundary tag helpers
+block* nextPhys(block* b);
+void setFree(block* b, size_t size);
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+/**
+ * allocate memory
+ **/
+void*
+kma_malloc(kma_size_t size)
+{
+	// if the requested size is greater than a page, ignore it
+	if ((size + HEADER) > PAGESIZE)
+	{
+		return NULL;
+	}
+
+	size_t need = (size + HEADER + ALIGNMENT - 1) & SIZEMASK;
+	if (need < MINBLOCK)
+	{
+		need = MINBLOCK;
+	}
+
+	block* b = findSuitable(need);
+	if (!b)
+	{
+		b = addPage();
+	}
+	removeBlock(b);
+
+	size_t bsize = b->size & SIZEMASK;
+	size_t flags = b->size & PREVFREEBIT;
+	if (bsize - need >= MINBLOCK)
+	{
+		// split, the rest stays free and keeps the next block's prev flag
+		block* rest = (block*)((void*)b + need);
+		setFree(rest, bsize - need);
+		insertBlock(rest);
+		b->size = need | flags;
+	}
+	else
+	{
+		block* next = nextPhys(b);
+		if (next)
+		{
+			next->size &= ~PREVFREEBIT;
+		}
+		b->size = bsize | flags;
+	}
+	return (void*)b + HEADER;
+}
+
+/**
+ * map a block size to its first and second level index
+ **/
+void mapping(size_t size, int* fl, int* sl)
+{
+	if (size < SMALLBLOCK)
+	{
+		*fl = 0;
+		*sl = size >> ALIGNSHIFT;
+	}
+	else
+	{
+		int f = 31 - __builtin_clz(size);
+		*sl = (size >> (f - SLBITS)) ^ SLCOUNT;
+		*fl = f - FLSHIFT + 1;
+	}
+}
+
+/**
+ * find a free block of at least size bytes
+ **/
+block* findSuitable(size_t size)
+{
+	int fl, sl;
+	// round up to the next list so that any block found is big enough
+	if (size >= SMALLBLOCK)
+	{
+		size += (1 << (31 - __builtin_clz(size) - SLBITS)) - 1;
+	}
+	mapping(size, &fl, &sl);
+
+	unsigned int map = (fl < FLCOUNT) ? slBitmap[fl] & (~0U << sl) : 0;
+	if (!map)
+	{
+		unsigned int flMap = flBitmap & (~0U << (fl + 1));
+		if (fl + 1 >= FLCOUNT || !flMap)
+		{
+			return NULL;
+		}
+		fl = __builtin_ffs(flMap) - 1;
+		map = slBitmap[fl];
+	}
+	sl = __builtin_ffs(map) - 1;
+	return freeLists[fl][sl];
+}
+
+/**
+ * add a new page as one free block
+ **/
+block* addPage()
+{
+	kma_page_t* page = get_page();
+	block* b = (block*)page->ptr;
+	setFree(b, PAGESIZE);
+	insertBlock(b);
+	return b;
+}
+
+/**
+ * insert a free block in front of its list
+ **/
+void insertBlock(block* b)
+{
+	int fl, sl;
+	mapping(b->size & SIZEMASK, &fl, &sl);
+	b->prev = NULL;
+	b->next = freeLists[fl][sl];
+	if (b->next)
+	{
+		b->next->prev = b;
+	}
+	freeLists[fl][sl] = b;
+	flBitmap |= 1U << fl;
+	slBitmap[fl] |= 1U << sl;
+}
+
+/**
+ * unlink a free block from its list
+ **/
+void removeBlock(block* b)
+{
+	int fl, sl;
+	mapping(b->size & SIZEMASK, &fl, &sl);
+	if (b->prev)
+	{
+		b->prev->next = b->next;
+	}
+	else
+	{
+		freeLists[fl][sl] = b->next;
+		if (!b->next)
+		{
+			slBitmap[fl] &= ~(1U << sl);
+			if (!slBitmap[fl])
+			{
+				flBitmap &= ~(1U << fl);
+			}
+		}
+	}
+	if (b->next)
+	{
+		b->next->prev = b->prev;
+	}
+}
+
+/**
+ * the block physically after b, NULL at the end of the page
+ **/
+block* nextPhys(block* b)
+{
+	void* next = (void*)b + (b->size & SIZEMASK);
+	if (next >= BASEADDR(b) + PAGESIZE)
+	{
+		return NULL;
+	}
+	return (block*)next;
+}
+
+/**
+ * mark a block free and write its footer, the previous block is
+ * always in use since free neighbours are merged
+ **/
+void setFree(block* b, size_t size)
+{
+	b->size = size | FREEBIT;
+	*((size_t*)((void*)b + size - sizeof(size_t))) = size;
+	block* next = nextPhys(b);
+	if (next)
+	{
+		next->size |= PREVFREEBIT;
+	}
+}
+
+/**
+ * free memory
+ **/
+void
+kma_free(void* ptr, kma_size_t size)
+{
+	block* b = (block*)(ptr - HEADER);
+	assert(!(b->size & FREEBIT));
+	size_t bsize = b->size & SIZEMASK;
+
+	// merge with the next block
+	block* next = nextPhys(b);
+	if (next && (next->size & FREEBIT))
+	{
+		removeBlock(next);
+		bsize += next->size & SIZEMASK;
+	}
+	// merge with the previous block, found through its footer
+	if (b->size & PREVFREEBIT)
+	{
+		size_t prevSize = *((size_t*)((void*)b - sizeof(size_t)));
+		block* prev = (block*)((void*)b - prevSize);
+		assert(prev->size & FREEBIT);
+		removeBlock(prev);
+		b = prev;
+		bsize += prevSize;
+	}
+
+	// the whole page is free again, give it back
+	if (bsize == PAGESIZE)
+	{
+		free_page(page_of(b));
+		return;
+	}
+	setFree(b, bsize);
+	insertBlock(b);
+}
+
+#endif // KMA_TLSF
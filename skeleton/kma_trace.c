@@ -0,0 +1,110 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Trace reader for the benchmark drivers
+ *    Author: Jin Sun, Yuchao Zhou
+ *    Copyright: 2014 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  Parses a trace file in the format of kma.c into an array of
+ *  operations, and times the replay. See kma_trace.h.
+ ***************************************************************************/
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/************Private include**********************************************/
+#include "kma_trace.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/************Global Variables*********************************************/
+
+/************Function Prototypes******************************************/
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+char *name = NULL;
+
+op_t*
+readTrace(char* file, int* n_req, int* n_ops)
+{
+  FILE* f_test = fopen(file, "r");
+  if (f_test == NULL)
+    {
+      error("unable to open input test file", file);
+    }
+
+  if (fscanf(f_test, "%d\n", n_req) != 1)
+    error("Couldn't read number of requests at head of file", "");
+
+  // every request is allocated and freed at most once
+  op_t* ops = malloc(2 * (*n_req) * sizeof(op_t));
+  assert(ops != NULL);
+
+  char command[16];
+  int count = 0;
+  op_t* op;
+
+  while (fscanf(f_test, "%10s", command) == 1)
+    {
+      assert(count < 2 * (*n_req));
+      op = &ops[count++];
+
+      if (strcmp(command, "REQUEST") == 0)
+	{
+	  op->type = OP_REQUEST;
+	  if (fscanf(f_test, "%d %d", &op->id, &op->size) != 2)
+	    error("Not enough arguments to REQUEST", "");
+	}
+      else if (strcmp(command, "FREE") == 0)
+	{
+	  op->type = OP_FREE;
+	  if (fscanf(f_test, "%d", &op->id) != 1)
+	    error("Not enough arguments to FREE", "");
+	  op->size = 0;
+	}
+      else
+	{
+	  error("unknown command type:", command);
+	}
+
+      assert(op->id >= 0 && op->id < *n_req);
+    }
+
+  fclose(f_test);
+  *n_ops = count;
+  return ops;
+}
+
+double
+now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void
+usage() {
+  printf("Usage: %s traceFile [rounds]\n", name);
+  exit(0);
+}
+
+void
+error(char* message, char* arg ) {
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(-1);
+}
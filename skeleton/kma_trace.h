@@ -0,0 +1,65 @@
+/***************************************************************************
+ *  Title: Trace Reader
+ * -------------------------------------------------------------------------
+ *    Purpose: Trace parsing and timing shared by the benchmark drivers
+ *    Author: Jin Sun, Yuchao Zhou
+ *    Copyright: 2014 Northwestern University
+ ***************************************************************************/
+/***************************************************************************
+ *  kma_trace.c is linked into kma_bench and kma_tlbbench, which replay
+ *  a trace file instead of kma.c. The driver sets name to argv[0]
+ *  before calling usage().
+ ***************************************************************************/
+
+#ifndef __KMA_TRACE_H__
+#define __KMA_TRACE_H__
+
+/************System include***********************************************/
+
+/************Private include**********************************************/
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+enum OP_TYPE
+  {
+    OP_REQUEST,
+    OP_FREE
+  };
+
+typedef struct
+{
+  enum OP_TYPE type;
+  int id;
+  int size; // only set for a request, may be 0
+} op_t;
+
+/************Global Variables*********************************************/
+extern char* name;
+
+/************Function Prototypes******************************************/
+
+/***********************************************************************
+ *  Title: Read a trace file
+ * ---------------------------------------------------------------------
+ *    Purpose: Parses the whole trace up front so that the replay only
+ *             times kma_malloc and kma_free
+ *    Input: the file name
+ *    Output: the operations in trace order, the number of requests in
+ *            *n_req and the number of operations in *n_ops. Exits on
+ *            a malformed trace
+ ***********************************************************************/
+op_t* readTrace(char* file, int* n_req, int* n_ops);
+
+// monotonic time in seconds
+double now();
+// print the command line of a driver and exit
+void usage();
+// print an error message and exit
+void error(char*, char*);
+
+#endif /* __KMA_TRACE_H__ */